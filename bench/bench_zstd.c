@@ -0,0 +1,988 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark of the ZSTD_COMPRESS filter, without httpd.
+ *
+ * mod_zstd.c is built in, with the few httpd functions it calls stubbed
+ * below, and compress_filter() is fed files the way a handler or a proxy
+ * would: split into buckets, passed a few buckets per brigade, with FLUSH
+ * buckets at will. For each file, level, number of workers and flush
+ * policy it reports the ratio, the throughput and CPU time of the filter,
+ * the heap allocations and peak (pools, buckets and zstd contexts alike),
+ * the time to the first output byte and the latency of the filter calls.
+ *
+ *   bench_zstd [-l levels] [-w workers] [-p policies] [-b bucket_size]
+ *              [-B buckets_per_brigade] [-F flush_every] [-d delay_usec]
+ *              [-n runs] [-c "Directive args"]... [-s] [-v] file...
+ *
+ * levels, workers and policies are comma separated lists, each combination
+ * is run. -c applies any directive of the module first, e.g.
+ * -c "ZstdWindowLog 23" or -c "ZstdOffloadThreads 4". With -s, each file
+ * is sent as a single FILE bucket, as the default handler does.
+ */
+
+#include "mod_zstd.c"
+
+#include "apr_getopt.h"
+#include "apr_general.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#if defined(__GLIBC__) && !defined(BENCH_NO_MALLOC_COUNT)
+#define BENCH_MALLOC_COUNT 1
+#include <malloc.h>
+#else
+#define BENCH_MALLOC_COUNT 0
+#endif
+
+/* What handlers write buckets of, APR_BUCKET_BUFF_SIZE */
+#define BENCH_DEFAULT_BUCKET_SIZE 8000
+#define BENCH_DEFAULT_RUNS 5
+#define BENCH_DEFAULT_LEVELS "3,10,15"
+#define BENCH_ACCEPT_ENCODING "gzip, deflate, br, zstd"
+
+#if BENCH_MALLOC_COUNT
+/*
+ * The heap is accounted for by interposing malloc() and friends, which
+ * APR pools and bucket allocators get their memory from, as zstd does.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *p);
+
+static size_t heap_allocs, heap_current, heap_peak;
+
+static void heap_add(void *p, size_t old) {
+
+    size_t cur, peak;
+
+    if (!p) {
+        return;
+    }
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    cur = __atomic_add_fetch(&heap_current, malloc_usable_size(p) - old,
+                             __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+    while (cur > peak
+           && !__atomic_compare_exchange_n(&heap_peak, &peak, cur, 1,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED)) {
+    }
+}
+
+void *malloc(size_t size) {
+
+    void *p = __libc_malloc(size);
+
+    heap_add(p, 0);
+    return p;
+}
+
+void *calloc(size_t n, size_t size) {
+
+    void *p = __libc_calloc(n, size);
+
+    heap_add(p, 0);
+    return p;
+}
+
+void *realloc(void *p, size_t size) {
+
+    size_t old = p ? malloc_usable_size(p) : 0;
+    void *q = __libc_realloc(p, size);
+
+    if (q) {
+        heap_add(q, old);
+    } else if (p && !size) {
+        __atomic_sub_fetch(&heap_current, old, __ATOMIC_RELAXED);
+    }
+    return q;
+}
+
+void *memalign(size_t align, size_t size) {
+
+    void *p = __libc_memalign(align, size);
+
+    heap_add(p, 0);
+    return p;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+
+    return memalign(align, size);
+}
+
+int posix_memalign(void **pp, size_t align, size_t size) {
+
+    *pp = memalign(align, size);
+    return *pp ? 0 : ENOMEM;
+}
+
+void free(void *p) {
+
+    if (p) {
+        __atomic_sub_fetch(&heap_current, malloc_usable_size(p),
+                           __ATOMIC_RELAXED);
+        __libc_free(p);
+    }
+}
+#endif
+
+/*
+ * httpd functions mod_zstd.c calls, as much of them as a request going
+ * through a chain of two filters needs.
+ */
+
+static int bench_verbose = 0;
+
+static void bench_vlog(int level, apr_status_t status, const char *fmt,
+                       va_list ap) {
+
+    char err[120];
+
+    fprintf(stderr, "[%d] ", level);
+    vfprintf(stderr, fmt, ap);
+    if (status != APR_SUCCESS) {
+        fprintf(stderr, ": %s", apr_strerror(status, err, sizeof(err)));
+    }
+    fputc('\n', stderr);
+}
+
+AP_DECLARE(void) ap_log_error_(const char *file, int line, int module_index,
+                               int level, apr_status_t status,
+                               const server_rec *s, const char *fmt, ...) {
+
+    va_list ap;
+
+    va_start(ap, fmt);
+    bench_vlog(level, status, fmt, ap);
+    va_end(ap);
+}
+
+AP_DECLARE(void) ap_log_rerror_(const char *file, int line, int module_index,
+                                int level, apr_status_t status,
+                                const request_rec *r, const char *fmt, ...) {
+
+    va_list ap;
+
+    va_start(ap, fmt);
+    bench_vlog(level, status, fmt, ap);
+    va_end(ap);
+}
+
+AP_DECLARE(apr_status_t) ap_pass_brigade(ap_filter_t *filter,
+                                         apr_bucket_brigade *bucket) {
+
+    return filter->frec->filter_func.out_func(filter, bucket);
+}
+
+AP_DECLARE(void) ap_remove_output_filter(ap_filter_t *f) {
+
+    ap_filter_t **of;
+
+    for (of = &f->r->output_filters; *of; of = &(*of)->next) {
+        if (*of == f) {
+            *of = f->next;
+            break;
+        }
+    }
+}
+
+AP_DECLARE(void) ap_remove_input_filter(ap_filter_t *f) {
+}
+
+AP_DECLARE(apr_status_t) ap_save_brigade(ap_filter_t *f,
+                                         apr_bucket_brigade **save_to,
+                                         apr_bucket_brigade **b,
+                                         apr_pool_t *p) {
+
+    apr_bucket *e;
+    apr_status_t rv, srv = APR_SUCCESS;
+
+    if (!*save_to) {
+        *save_to = apr_brigade_create(p, f->c->bucket_alloc);
+    }
+    for (e = APR_BRIGADE_FIRST(*b);
+         e != APR_BRIGADE_SENTINEL(*b);
+         e = APR_BUCKET_NEXT(e)) {
+        rv = apr_bucket_setaside(e, p);
+        if (rv == APR_ENOTIMPL) {
+            const char *s;
+            apr_size_t n;
+
+            rv = apr_bucket_read(e, &s, &n, APR_BLOCK_READ);
+            if (rv == APR_SUCCESS) {
+                rv = apr_bucket_setaside(e, p);
+            }
+        }
+        if (rv != APR_SUCCESS) {
+            srv = rv;
+        }
+    }
+    APR_BRIGADE_CONCAT(*save_to, *b);
+
+    return srv;
+}
+
+AP_DECLARE(apr_status_t) ap_get_brigade(ap_filter_t *filter,
+                                        apr_bucket_brigade *bucket,
+                                        ap_input_mode_t mode,
+                                        apr_read_type_e block,
+                                        apr_off_t readbytes) {
+    return APR_EOF;
+}
+
+AP_DECLARE(ap_filter_rec_t *) ap_register_output_filter(const char *name,
+                                          ap_out_filter_func filter_func,
+                                          ap_init_filter_func filter_init,
+                                          ap_filter_type ftype) {
+    return NULL;
+}
+
+AP_DECLARE(ap_filter_t *) ap_add_output_filter_handle(ap_filter_rec_t *f,
+                                                      void *ctx,
+                                                      request_rec *r,
+                                                      conn_rec *c) {
+    return NULL;
+}
+
+AP_DECLARE(ap_filter_rec_t *) ap_register_input_filter(const char *name,
+                                          ap_in_filter_func filter_func,
+                                          ap_init_filter_func filter_init,
+                                          ap_filter_type ftype) {
+    return NULL;
+}
+
+AP_DECLARE(void) ap_set_content_length(request_rec *r, apr_off_t length) {
+
+    r->clength = length;
+    apr_table_setn(r->headers_out, "Content-Length",
+                   apr_off_t_toa(r->pool, length));
+}
+
+AP_DECLARE(void) ap_set_content_type(request_rec *r, const char *ct) {
+
+    r->content_type = ct;
+}
+
+AP_DECLARE(int) ap_is_initial_req(request_rec *r) {
+
+    return !r->main && !r->prev;
+}
+
+AP_DECLARE(apr_off_t) ap_get_limit_req_body(const request_rec *r) {
+
+    return 0;
+}
+
+AP_DECLARE(int) ap_cstr_casecmp(const char *s1, const char *s2) {
+
+    return strcasecmp(s1, s2);
+}
+
+AP_DECLARE(int) ap_cstr_casecmpn(const char *s1, const char *s2,
+                                 apr_size_t n) {
+
+    return strncasecmp(s1, s2, n);
+}
+
+AP_DECLARE(void) ap_bin2hex(const void *src, apr_size_t srclen, char *dest) {
+
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *in = src;
+    apr_size_t i;
+
+    for (i = 0; i < srclen; i++) {
+        *dest++ = hex[in[i] >> 4];
+        *dest++ = hex[in[i] & 0xf];
+    }
+    *dest = '\0';
+}
+
+AP_DECLARE(char *) ap_get_token(apr_pool_t *p, const char **accept_line,
+                                int accept_white) {
+
+    const char *s = *accept_line;
+    const char *start;
+
+    while (apr_isspace(*s)) {
+        ++s;
+    }
+    start = s;
+    while (*s && *s != ',' && *s != ';'
+           && (accept_white || !apr_isspace(*s))) {
+        ++s;
+    }
+    *accept_line = s;
+
+    return apr_pstrmemdup(p, start, s - start);
+}
+
+/* Close enough for the headers the benchmark never sets */
+AP_DECLARE(int) ap_find_token(apr_pool_t *p, const char *line,
+                              const char *tok) {
+
+    return line && strstr(line, tok) != NULL;
+}
+
+AP_DECLARE(const char *) ap_check_cmd_context(cmd_parms *cmd,
+                                              unsigned forbidden) {
+    return NULL;
+}
+
+AP_DECLARE(char *) ap_server_root_relative(apr_pool_t *p, const char *fname) {
+
+    return apr_pstrdup(p, fname);
+}
+
+AP_DECLARE(char *) ap_runtime_dir_relative(apr_pool_t *p, const char *fname) {
+
+    return apr_pstrdup(p, fname);
+}
+
+AP_DECLARE(apr_status_t) ap_mpm_query(int query_code, int *result) {
+
+    *result = 1;
+    return APR_SUCCESS;
+}
+
+AP_DECLARE(int) ap_state_query(int query_code) {
+
+    return AP_SQ_NOT_SUPPORTED;
+}
+
+AP_DECLARE(int) ap_exists_scoreboard_image(void) {
+
+    return 0;
+}
+
+AP_DECLARE(worker_score *) ap_get_scoreboard_worker_from_indexes(
+                               int child_num, int thread_num) {
+    return NULL;
+}
+
+AP_DECLARE(void) ap_add_version_component(apr_pool_t *pconf,
+                                          const char *component) {
+}
+
+AP_DECLARE(char *) ap_escape_html2(apr_pool_t *p, const char *s, int toasc) {
+
+    return apr_pstrdup(p, s);
+}
+
+AP_DECLARE_NONSTD(int) ap_rprintf(request_rec *r, const char *fmt, ...) {
+
+    return 0;
+}
+
+AP_DECLARE(int) ap_rwrite(const void *buf, int nbyte, request_rec *r) {
+
+    return nbyte;
+}
+
+AP_DECLARE(void) ap_hook_post_config(ap_HOOK_post_config_t *pf,
+                                     const char * const *aszPre,
+                                     const char * const *aszSucc,
+                                     int nOrder) {
+}
+
+AP_DECLARE(void) ap_hook_child_init(ap_HOOK_child_init_t *pf,
+                                    const char * const *aszPre,
+                                    const char * const *aszSucc,
+                                    int nOrder) {
+}
+
+AP_DECLARE(void) ap_hook_insert_filter(ap_HOOK_insert_filter_t *pf,
+                                       const char * const *aszPre,
+                                       const char * const *aszSucc,
+                                       int nOrder) {
+}
+
+AP_DECLARE(void) ap_hook_handler(ap_HOOK_handler_t *pf,
+                                 const char * const *aszPre,
+                                 const char * const *aszSucc,
+                                 int nOrder) {
+}
+
+/*
+ * The benchmark
+ */
+
+typedef struct bench_file_t {
+    const char *path;
+    const char *name;
+    const char *type;
+    apr_finfo_t finfo;
+    const char *data;
+} bench_file_t;
+
+/* What reaches the network: the filter after ZSTD_COMPRESS */
+typedef struct bench_sink_t {
+    apr_off_t bytes;
+    int flushes;
+    apr_time_t first_out;
+} bench_sink_t;
+
+typedef struct bench_t {
+    apr_pool_t *pool;
+    server_rec *server;
+    apr_bucket_alloc_t *alloc;
+    void *core_dconf;
+    void *base_dconf;
+    apr_array_header_t *directives;
+    apr_size_t bucket_size;
+    int per_brigade;
+    int flush_every;
+    apr_interval_time_t delay;
+    int runs;
+    int static_file;
+} bench_t;
+
+/* Totals over the runs of a combination */
+typedef struct bench_result_t {
+    apr_off_t bytes_in;
+    apr_off_t bytes_out;
+    const char *encoding;
+    apr_interval_time_t filter_usec;    /* in the filter, delays excluded */
+    apr_interval_time_t first_out_usec;
+    clock_t cpu;
+    apr_size_t allocs;
+    apr_size_t peak;
+    apr_array_header_t *latencies;
+} bench_result_t;
+
+static ap_filter_rec_t bench_zstd_frec;
+static ap_filter_rec_t bench_sink_frec;
+
+static apr_status_t bench_sink(ap_filter_t *f, apr_bucket_brigade *bb) {
+
+    bench_sink_t *sink = f->ctx;
+    apr_bucket *e;
+
+    for (e = APR_BRIGADE_FIRST(bb);
+         e != APR_BRIGADE_SENTINEL(bb);
+         e = APR_BUCKET_NEXT(e)) {
+        if (APR_BUCKET_IS_FLUSH(e)) {
+            sink->flushes++;
+        } else if (!APR_BUCKET_IS_METADATA(e) && e->length) {
+            if (!sink->first_out) {
+                sink->first_out = apr_time_now();
+            }
+            sink->bytes += e->length;
+        }
+    }
+    apr_brigade_cleanup(bb);
+
+    return APR_SUCCESS;
+}
+
+/* Apply a directive of the module, as written in httpd.conf */
+static const char *bench_directive(bench_t *b, void *dconf,
+                                   const char *line) {
+
+    const command_rec *cmd;
+    cmd_parms parms;
+    char *args[3] = { NULL, NULL, NULL };
+    char *name, *last;
+    int n = 0;
+
+    name = apr_strtok(apr_pstrdup(b->pool, line), " \t", &last);
+    while (name && n < 3 && (args[n] = apr_strtok(NULL, " \t", &last))) {
+        n++;
+    }
+    for (cmd = cmds; name && cmd->name; cmd++) {
+        if (!strcasecmp(cmd->name, name)) {
+            break;
+        }
+    }
+    if (!name || !cmd->name) {
+        return apr_psprintf(b->pool, "Unknown directive '%s'", line);
+    }
+
+    memset(&parms, 0, sizeof(parms));
+    parms.pool = parms.temp_pool = b->pool;
+    parms.server = b->server;
+    parms.cmd = cmd;
+    parms.info = cmd->cmd_data;
+
+    switch (cmd->args_how) {
+    case FLAG:
+        if (n != 1) {
+            break;
+        }
+        return cmd->AP_FLAG(&parms, dconf, !strcasecmp(args[0], "On"));
+    case TAKE1:
+        if (n != 1) {
+            break;
+        }
+        return cmd->AP_TAKE1(&parms, dconf, args[0]);
+    case TAKE2:
+    case TAKE12:
+        if (n < 1 || n > 2) {
+            break;
+        }
+        return cmd->AP_TAKE2(&parms, dconf, args[0], args[1]);
+    case TAKE3:
+    case TAKE13:
+    case TAKE23:
+    case TAKE123:
+        if (n < 1) {
+            break;
+        }
+        return cmd->AP_TAKE3(&parms, dconf, args[0], args[1], args[2]);
+    default:
+        return apr_psprintf(b->pool, "%s is not supported here", cmd->name);
+    }
+
+    return apr_psprintf(b->pool, "Wrong number of arguments: '%s'", line);
+}
+
+static const char *bench_type(const char *path) {
+
+    static const char *const types[][2] = {
+        { ".html", "text/html" }, { ".htm", "text/html" },
+        { ".css", "text/css" }, { ".js", "application/javascript" },
+        { ".mjs", "application/javascript" },
+        { ".json", "application/json" }, { ".xml", "application/xml" },
+        { ".svg", "image/svg+xml" }, { ".txt", "text/plain" }
+    };
+    const char *ext = strrchr(path, '.');
+    apr_size_t i;
+
+    for (i = 0; ext && i < sizeof(types) / sizeof(types[0]); i++) {
+        if (!strcasecmp(ext, types[i][0])) {
+            return types[i][1];
+        }
+    }
+    return "application/octet-stream";
+}
+
+static apr_status_t bench_load(bench_t *b, bench_file_t *file) {
+
+    apr_file_t *fd;
+    apr_size_t len;
+    char *data;
+    apr_status_t rv;
+
+    rv = apr_file_open(&fd, file->path, APR_FOPEN_READ | APR_FOPEN_BINARY,
+                       APR_FPROT_OS_DEFAULT, b->pool);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_info_get(&file->finfo, APR_FINFO_NORM, fd);
+    }
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    len = (apr_size_t)file->finfo.size;
+    data = apr_palloc(b->pool, len + 1);
+    rv = apr_file_read_full(fd, data, len, NULL);
+    apr_file_close(fd);
+
+    file->data = data;
+    file->name = strrchr(file->path, '/') ? strrchr(file->path, '/') + 1
+                                          : file->path;
+    file->type = bench_type(file->path);
+
+    return rv;
+}
+
+/* One request for a file, from its handler to the network */
+static apr_status_t bench_request(bench_t *b, bench_file_t *file,
+                                  void *dconf, bench_result_t *res) {
+
+    apr_pool_t *p;
+    request_rec *r;
+    conn_rec *c;
+    ap_filter_t *zf, *sf;
+    bench_sink_t sink;
+    apr_bucket_brigade *bb;
+    apr_off_t off = 0;
+    apr_time_t start, t;
+#if BENCH_MALLOC_COUNT
+    apr_size_t allocs, base;
+#endif
+    clock_t cpu;
+    int nbuckets = 0;
+    apr_status_t rv = APR_SUCCESS;
+
+    apr_pool_create(&p, b->pool);
+
+    c = apr_pcalloc(p, sizeof(*c));
+    c->pool = p;
+    c->base_server = b->server;
+    c->bucket_alloc = b->alloc;
+
+    r = apr_pcalloc(p, sizeof(*r));
+    r->pool = p;
+    r->connection = c;
+    r->server = b->server;
+    r->per_dir_config = apr_pcalloc(p, sizeof(void *) * 2);
+    ((void **)r->per_dir_config)[AP_CORE_MODULE_INDEX] = b->core_dconf;
+    ap_set_module_config(r->per_dir_config, &zstd_module, dconf);
+    r->request_config = apr_pcalloc(p, sizeof(void *) * 2);
+    r->headers_in = apr_table_make(p, 4);
+    r->headers_out = apr_table_make(p, 8);
+    r->err_headers_out = apr_table_make(p, 1);
+    r->subprocess_env = apr_table_make(p, 4);
+    r->notes = apr_table_make(p, 4);
+    apr_table_setn(r->headers_in, "Accept-Encoding", BENCH_ACCEPT_ENCODING);
+    r->method = "GET";
+    r->method_number = M_GET;
+    r->status = HTTP_OK;
+    r->uri = apr_pstrcat(p, "/", file->name, NULL);
+    r->the_request = apr_pstrcat(p, "GET ", r->uri, " HTTP/1.1", NULL);
+    r->content_type = file->type;
+    if (b->static_file) {
+        r->filename = apr_pstrdup(p, file->path);
+        r->finfo = file->finfo;
+    }
+
+    memset(&sink, 0, sizeof(sink));
+    sf = apr_pcalloc(p, sizeof(*sf));
+    sf->frec = &bench_sink_frec;
+    sf->ctx = &sink;
+    sf->r = r;
+    sf->c = c;
+    zf = apr_pcalloc(p, sizeof(*zf));
+    zf->frec = &bench_zstd_frec;
+    zf->next = sf;
+    zf->r = r;
+    zf->c = c;
+    r->output_filters = zf;
+
+    bb = apr_brigade_create(p, c->bucket_alloc);
+
+#if BENCH_MALLOC_COUNT
+    allocs = heap_allocs;
+    base = heap_peak = heap_current;
+#endif
+    cpu = clock();
+    start = apr_time_now();
+
+    if (b->static_file) {
+        apr_file_t *fd;
+
+        rv = apr_file_open(&fd, file->path, APR_FOPEN_READ
+                           | APR_FOPEN_BINARY, APR_FPROT_OS_DEFAULT, p);
+        if (rv == APR_SUCCESS) {
+            apr_brigade_insert_file(bb, fd, 0, file->finfo.size, p);
+            APR_BRIGADE_INSERT_TAIL(bb,
+                                    apr_bucket_eos_create(c->bucket_alloc));
+            t = apr_time_now();
+            rv = ap_pass_brigade(r->output_filters, bb);
+            t = apr_time_now() - t;
+            *(apr_interval_time_t *)apr_array_push(res->latencies) = t;
+            res->filter_usec += t;
+        }
+    }
+
+    while (!b->static_file && rv == APR_SUCCESS) {
+        apr_size_t len = (apr_size_t)(file->finfo.size - off);
+        int last;
+
+        if (len > b->bucket_size) {
+            len = b->bucket_size;
+        }
+        if (len) {
+            APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create(
+                                    file->data + off, len, c->bucket_alloc));
+            off += len;
+            nbuckets++;
+        }
+        last = (off == file->finfo.size);
+
+        if (b->flush_every && !last && nbuckets % b->flush_every == 0) {
+            APR_BRIGADE_INSERT_TAIL(bb,
+                                    apr_bucket_flush_create(c->bucket_alloc));
+        }
+        if (last) {
+            APR_BRIGADE_INSERT_TAIL(bb,
+                                    apr_bucket_eos_create(c->bucket_alloc));
+        } else if (nbuckets % b->per_brigade) {
+            continue;
+        }
+
+        t = apr_time_now();
+        rv = ap_pass_brigade(r->output_filters, bb);
+        t = apr_time_now() - t;
+        *(apr_interval_time_t *)apr_array_push(res->latencies) = t;
+        res->filter_usec += t;
+        apr_brigade_cleanup(bb);
+        if (last) {
+            break;
+        }
+        if (b->delay) {
+            apr_sleep(b->delay);
+        }
+    }
+
+    res->cpu += clock() - cpu;
+    if (sink.first_out) {
+        res->first_out_usec += sink.first_out - start;
+    }
+    res->bytes_in += file->finfo.size;
+    res->bytes_out += sink.bytes;
+    res->encoding = apr_table_get(r->headers_out, "Content-Encoding");
+    res->encoding = apr_pstrdup(b->pool, res->encoding ? res->encoding
+                                                       : "identity");
+
+    /* The request ends: its zstd context goes back to the pool */
+    apr_pool_destroy(p);
+
+#if BENCH_MALLOC_COUNT
+    res->allocs += heap_allocs - allocs;
+    if (heap_peak - base > res->peak) {
+        res->peak = heap_peak - base;
+    }
+#endif
+
+    return rv;
+}
+
+static int bench_cmp_latency(const void *a, const void *b) {
+
+    apr_interval_time_t x = *(const apr_interval_time_t *)a;
+    apr_interval_time_t y = *(const apr_interval_time_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void bench_print(bench_t *b, bench_file_t *file, const char *level,
+                        const char *workers, const char *policy,
+                        bench_result_t *res) {
+
+    apr_interval_time_t *lat = (apr_interval_time_t *)res->latencies->elts;
+    int n = res->latencies->nelts;
+
+    qsort(lat, n, sizeof(*lat), bench_cmp_latency);
+    printf("%-20.20s %-5s %-3s %-9s %-8s %10" APR_OFF_T_FMT " %10"
+           APR_OFF_T_FMT " %6.2f %8.1f %8.2f %8.2f",
+           file->name, level, workers, policy, res->encoding,
+           res->bytes_in / b->runs, res->bytes_out / b->runs,
+           res->bytes_in ? 100.0 * res->bytes_out / res->bytes_in : 0.0,
+           res->filter_usec ? (double)res->bytes_in / res->filter_usec : 0.0,
+           1000.0 * res->cpu / CLOCKS_PER_SEC / b->runs,
+           res->first_out_usec / 1000.0 / b->runs);
+#if BENCH_MALLOC_COUNT
+    printf(" %8" APR_SIZE_T_FMT " %8" APR_SIZE_T_FMT,
+           res->allocs / b->runs, res->peak / 1024);
+#else
+    printf(" %8s %8s", "-", "-");
+#endif
+    printf(" %8" APR_TIME_T_FMT " %8" APR_TIME_T_FMT " %8" APR_TIME_T_FMT
+           "\n", lat[n / 2], lat[(n * 99) / 100], lat[n - 1]);
+}
+
+static void usage(const char *argv0) {
+
+    fprintf(stderr,
+            "Usage: %s [options] file...\n"
+            "  -l levels     compression levels, comma separated "
+            "(default " BENCH_DEFAULT_LEVELS ")\n"
+            "  -w workers    ZstdWorkers values, comma separated "
+            "(default 0)\n"
+            "  -p policies   ZstdFlushPolicy values, comma separated "
+            "(default auto)\n"
+            "  -b size       bytes per bucket (default %d)\n"
+            "  -B buckets    buckets per brigade (default 1)\n"
+            "  -F buckets    a FLUSH bucket every that many buckets "
+            "(default none)\n"
+            "  -d usec       delay between brigades (default none)\n"
+            "  -n runs       requests per combination (default %d)\n"
+            "  -c directive  apply a directive first, e.g. "
+            "\"ZstdWindowLog 23\"\n"
+            "  -s            send files as a FILE bucket, "
+            "as the default handler\n"
+            "  -v            log what the module logs\n",
+            argv0, BENCH_DEFAULT_BUCKET_SIZE, BENCH_DEFAULT_RUNS);
+    exit(1);
+}
+
+int main(int argc, const char *const *argv) {
+
+    apr_pool_t *pool;
+    apr_getopt_t *opt;
+    bench_t bench, *b = &bench;
+    const char *levels = BENCH_DEFAULT_LEVELS;
+    const char *workers = "0";
+    const char *policies = "auto";
+    const char *arg;
+    char optch;
+    int i;
+    apr_status_t rv;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+
+    memset(b, 0, sizeof(*b));
+    b->pool = pool;
+    b->bucket_size = BENCH_DEFAULT_BUCKET_SIZE;
+    b->per_brigade = 1;
+    b->runs = BENCH_DEFAULT_RUNS;
+    b->directives = apr_array_make(pool, 4, sizeof(const char *));
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((rv = apr_getopt(opt, "l:w:p:b:B:F:d:n:c:sv", &optch, &arg))
+           == APR_SUCCESS) {
+        switch (optch) {
+        case 'l':
+            levels = arg;
+            break;
+        case 'w':
+            workers = arg;
+            break;
+        case 'p':
+            policies = arg;
+            break;
+        case 'b':
+            b->bucket_size = (apr_size_t)atol(arg);
+            break;
+        case 'B':
+            b->per_brigade = atoi(arg);
+            break;
+        case 'F':
+            b->flush_every = atoi(arg);
+            break;
+        case 'd':
+            b->delay = atol(arg);
+            break;
+        case 'n':
+            b->runs = atoi(arg);
+            break;
+        case 'c':
+            *(const char **)apr_array_push(b->directives) = arg;
+            break;
+        case 's':
+            b->static_file = 1;
+            break;
+        case 'v':
+            bench_verbose = 1;
+            break;
+        }
+    }
+    if (rv != APR_EOF || opt->ind >= argc || !b->bucket_size
+        || b->per_brigade < 1 || b->runs < 1) {
+        usage(argv[0]);
+    }
+
+    /* A server with the module configured, and a child process of it */
+    zstd_module.module_index = 1;
+    b->server = apr_pcalloc(pool, sizeof(*b->server));
+    b->server->process = apr_pcalloc(pool, sizeof(*b->server->process));
+    b->server->process->pool = b->server->process->pconf = pool;
+    b->server->server_hostname = "localhost";
+    b->server->log.level = bench_verbose ? APLOG_DEBUG : APLOG_WARNING;
+    b->server->module_config = apr_pcalloc(pool, sizeof(void *) * 2);
+    ap_set_module_config(b->server->module_config, &zstd_module,
+                         create_server_config(pool, b->server));
+    b->core_dconf = apr_pcalloc(pool, sizeof(core_dir_config));
+    b->base_dconf = create_dir_config(pool, NULL);
+    b->alloc = apr_bucket_alloc_create(pool);
+
+    for (i = 0; i < b->directives->nelts; i++) {
+        const char *err = bench_directive(b, b->base_dconf,
+                                          APR_ARRAY_IDX(b->directives, i,
+                                                        const char *));
+        if (err) {
+            fprintf(stderr, "%s\n", err);
+            return 1;
+        }
+    }
+    /* for ZstdContextPrewarm */
+    b->server->lookup_defaults = apr_pcalloc(pool, sizeof(void *) * 2);
+    ap_set_module_config(b->server->lookup_defaults, &zstd_module,
+                         b->base_dconf);
+    zstd_child_init(pool, b->server);
+
+    bench_zstd_frec.name = "zstd_compress";
+    bench_zstd_frec.filter_func.out_func = compress_filter;
+    bench_sink_frec.name = "bench_sink";
+    bench_sink_frec.filter_func.out_func = bench_sink;
+
+    printf("%-20s %-5s %-3s %-9s %-8s %10s %10s %6s %8s %8s %8s %8s %8s "
+           "%8s %8s %8s\n", "file", "level", "wk", "policy", "encoding",
+           "in", "out", "ratio%", "MB/s", "cpu_ms", "ttfb_ms", "allocs",
+           "peak_KB", "p50_us", "p99_us", "max_us");
+
+    for (i = opt->ind; i < argc; i++) {
+        bench_file_t file;
+        char *l, *w, *pl, *ll, *lw, *lp;
+
+        memset(&file, 0, sizeof(file));
+        file.path = argv[i];
+        rv = bench_load(b, &file);
+        if (rv != APR_SUCCESS) {
+            char err[120];
+
+            fprintf(stderr, "%s: %s\n", file.path,
+                    apr_strerror(rv, err, sizeof(err)));
+            return 1;
+        }
+
+        for (l = apr_strtok(apr_pstrdup(pool, levels), ",", &ll); l;
+             l = apr_strtok(NULL, ",", &ll)) {
+        for (w = apr_strtok(apr_pstrdup(pool, workers), ",", &lw); w;
+             w = apr_strtok(NULL, ",", &lw)) {
+        for (pl = apr_strtok(apr_pstrdup(pool, policies), ",", &lp); pl;
+             pl = apr_strtok(NULL, ",", &lp)) {
+            void *dconf = create_dir_config(pool, NULL);
+            bench_result_t res;
+            const char *err;
+            int run;
+
+            err = bench_directive(b, dconf, apr_pstrcat(pool,
+                                  "ZstdCompressionLevel ", l, NULL));
+            if (!err) {
+                err = bench_directive(b, dconf, apr_pstrcat(pool,
+                                      "ZstdWorkers ", w, NULL));
+            }
+            if (!err) {
+                err = bench_directive(b, dconf, apr_pstrcat(pool,
+                                      "ZstdFlushPolicy ", pl, NULL));
+            }
+            if (err) {
+                fprintf(stderr, "%s\n", err);
+                return 1;
+            }
+            dconf = merge_dir_config(pool, b->base_dconf, dconf);
+
+            memset(&res, 0, sizeof(res));
+            res.latencies = apr_array_make(pool, 64,
+                                           sizeof(apr_interval_time_t));
+            for (run = 0; run < b->runs; run++) {
+                rv = bench_request(b, &file, dconf, &res);
+                if (rv != APR_SUCCESS) {
+                    char errbuf[120];
+
+                    fprintf(stderr, "%s: %s\n", file.path,
+                            apr_strerror(rv, errbuf, sizeof(errbuf)));
+                    return 1;
+                }
+            }
+            bench_print(b, &file, l, w, pl, &res);
+        }
+        }
+        }
+    }
+
+    return 0;
+}
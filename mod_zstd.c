@@ -17,8 +17,38 @@
 #include "httpd.h"
 #include "http_core.h"
 #include "http_log.h"
+#include "http_protocol.h"
+#include "mod_status.h"
+#include "ap_mpm.h"
+#include "scoreboard.h"
 #include "apr_strings.h"
+#include "apr_thread_mutex.h"
+#include "apr_atomic.h"
+#include "apr_file_io.h"
+#include "apr_base64.h"
+#include "apr_shm.h"
+#include "apr_version.h"
+#if APR_MAJOR_VERSION < 2
+#include "apu_version.h"
+#endif
+#if APR_HAS_THREADS
+#include "apr_thread_pool.h"
+#include "apr_thread_cond.h"
+#endif
+
+#include <math.h>
+#ifdef MOD_ZSTD_USDT
+#include <sys/sdt.h>
+#endif
 
+/* The experimental API: ZSTD_createCDict_advanced(), ZSTD_getCParams(),
+ * ZSTD_createThreadPool(), ZSTD_c_targetCBlockSize, ZSTD_CCtxParams_*() and
+ * ZSTD_estimateCStreamSize_usingCCtxParams(). Its structures, parameters
+ * and semantics may change with any release: what depends on them is only
+ * used with the libzstd built against (see zstd_post_config()). The
+ * ZSTD_CCtx_params functions only take opaque handles, and are kept.
+ */
+#define ZSTD_STATIC_LINKING_ONLY
 #include <zstd.h>
 #include "mod_zstd.h"
 
@@ -27,15 +57,85 @@
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <time.h>
 #endif
 
 module AP_MODULE_DECLARE_DATA zstd_module;
 
-static void *create_server_config(apr_pool_t *p, server_rec *s) {
+/* Per child process pool of idle compression contexts */
+static zstd_cctx_pool_t *cctx_pool = NULL;
+/* and of decompression contexts, for ZSTD_DECOMPRESS and ZSTD_INFLATE */
+static zstd_dctx_pool_t *dctx_pool = NULL;
 
-    zstd_server_config_t *conf = apr_pcalloc(p, sizeof(*conf));
-    conf->compression_level = ZSTD_DEFAULT_COMPRESSION_LEVEL;
-    conf->etag_mode = ETAG_MODE_ADDSUFFIX;
+#if ZSTD_HAS_THREAD_POOL
+/* Per child process threads compression jobs are offloaded to */
+static ZSTD_threadPool *offload_pool = NULL;
+#endif
+/* Whether the libzstd loaded is the one built against */
+static int experimental_api = 1;
+
+/* Per child process budget of zstd worker threads, shared by all requests */
+static apr_uint32_t workers_limit = 0;
+static volatile apr_uint32_t workers_busy = 0;
+
+/* Per child process budget of compression context memory, ZstdMaxMemory */
+static apr_uint64_t memory_limit = 0;
+static volatile apr_uint64_t memory_used = 0;
+
+/* Load of the child process and of the server, for ZstdAdaptiveLevel */
+static volatile apr_uint32_t ctx_active = 0;
+static int threads_per_child = 1;
+static int busy_permille = 0;
+static apr_time_t busy_sampled = 0;
+
+/* Statistics in shared memory, ZSTD_TYPE_MAX rows per server */
+static apr_shm_t *stats_shm = NULL;
+static zstd_stats_t *stats_rows = NULL;
+static const char **stats_servers = NULL;
+static int stats_nservers = 0;
+
+static const char *const stats_type_names[ZSTD_TYPE_MAX] = {
+    "html", "css", "javascript", "json", "xml", "svg", "text", "other"
+};
+
+/* ZstdStrategy, indexed by ZSTD_strategy (0 is the level's own) */
+static const char *const strategy_names[] = {
+    "default", "fast", "dfast", "greedy", "lazy", "lazy2", "btlazy2",
+    "btopt", "btultra", "btultra2"
+};
+
+static const char *const stats_skip_names[ZSTD_SKIP_MAX] = {
+    "ineligible", "encoded", "not_accepted", "not_modified", "too_small",
+    "too_large", "incompressible", "preference", "range", "memory",
+    "error"
+};
+
+/* ZstdFilterNote types, indexed by filter_note_e */
+static const char *const filter_note_names[FILTER_NOTE_MAX] = {
+    "Ratio", "Input", "Output", "Time", "CPU", "Calls", "Flushes",
+    "Buffered", "Pool", "Level", "Workers"
+};
+
+/* Accept-Encoding tokens, indexed by zstd_coding_e */
+static const char *const coding_names[ZSTD_CODING_MAX] = {
+    "zstd", "dcz", "br", "gzip"
+};
+
+#if APR_HAS_THREADS
+/* Background compression of static files for ZstdCacheRoot */
+static apr_thread_pool_t *cache_threads = NULL;
+static apr_thread_mutex_t *cache_mutex = NULL;
+static apr_thread_cond_t *cache_cond = NULL;
+static apr_uint64_t cache_inflight[ZSTD_CACHE_INFLIGHT_MAX];
+/* ZstdCacheMaxSize: bytes this child wrote to the cache since it swept it */
+static apr_uint64_t cache_written = 0;
+static apr_uint32_t cache_sweeping = 0;
+#endif
+
+/* Number of CPUs, which is the default number of workers */
+static int online_cpus(void) {
+
+    int cpus;
 
     #ifdef _WIN32
     #ifndef _SC_NPROCESSORS_ONLN
@@ -46,49 +146,271 @@ static void *create_server_config(apr_pool_t *p, server_rec *s) {
     #endif
     #endif
     #ifdef _SC_NPROCESSORS_ONLN
-        conf->workers = sysconf(_SC_NPROCESSORS_ONLN);
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
     #else
         /*
          * https://facebook.github.io/zstd/zstd_manual.html#Chapter5
          * Default value is `0`, 
          * aka "single-threaded mode" : no worker is spawned
          */
-        conf->workers = 0;
+        cpus = 0;
     #endif
 
+    return cpus;
+}
+
+/* Default ZstdWorkers, not to ask the system for each request */
+static int default_workers;
+
+static void *create_server_config(apr_pool_t *p, server_rec *s) {
+
+    zstd_server_config_t *conf = apr_pcalloc(p, sizeof(*conf));
+    conf->cctx_pool_size = ZSTD_DEFAULT_CCTX_POOL_SIZE;
+    conf->workers_limit = default_workers = online_cpus();
+    conf->cache_level = ZSTD_UNSET;
+    conf->cache_frame_size = ZSTD_UNSET;
+    conf->cache_max_size = ZSTD_UNSET;
+
+    return conf;
+}
+
+static void *merge_server_config(apr_pool_t *p, void *basev, void *addv) {
+
+    zstd_server_config_t *base = basev;
+    zstd_server_config_t *add = addv;
+    zstd_server_config_t *conf = apr_pmemdup(p, add, sizeof(*conf));
+    int i;
+
+    conf->cache_root = add->cache_root ? add->cache_root : base->cache_root;
+    conf->cache_level = (add->cache_level != ZSTD_UNSET) ? add->cache_level
+                                                         : base->cache_level;
+    conf->cache_frame_size = (add->cache_frame_size != ZSTD_UNSET)
+                             ? add->cache_frame_size : base->cache_frame_size;
+    conf->cache_max_size = (add->cache_max_size != ZSTD_UNSET)
+                           ? add->cache_max_size : base->cache_max_size;
+    for (i = 0; i < FILTER_NOTE_MAX; i++) {
+        conf->note_names[i] = add->note_names[i] ? add->note_names[i]
+                                                 : base->note_names[i];
+    }
+    conf->dictionaries = add->dictionaries ? add->dictionaries
+                                           : base->dictionaries;
+
     return conf;
 }
 
+static void *create_dir_config(apr_pool_t *p, char *dummy) {
+
+    zstd_dir_config_t *dconf = apr_palloc(p, sizeof(*dconf));
+    dconf->enabled = ZSTD_UNSET;
+    dconf->compression_level = ZSTD_UNSET;
+    dconf->adaptive_min = dconf->adaptive_max = ZSTD_UNSET;
+    dconf->workers = ZSTD_UNSET;
+    dconf->workers_min_size = ZSTD_UNSET;
+    dconf->flush_policy = FLUSH_POLICY_UNSET;
+    dconf->flush_threshold = ZSTD_UNSET;
+    dconf->etag_mode = ETAG_MODE_UNSET;
+    dconf->precompressed = ZSTD_UNSET;
+    dconf->out_buffer_size = ZSTD_UNSET;
+    dconf->min_length = ZSTD_UNSET;
+    dconf->max_length = ZSTD_UNSET;
+    dconf->probe = ZSTD_UNSET;
+    dconf->window_log = ZSTD_UNSET;
+    dconf->ldm = ZSTD_UNSET;
+    dconf->strategy = ZSTD_UNSET;
+    dconf->checksum = ZSTD_UNSET;
+    dconf->target_cblock_size = ZSTD_UNSET;
+    dconf->inflate_limit = ZSTD_UNSET;
+    dconf->inflate_ratio = ZSTD_UNSET;
+    dconf->inflate_window_log = ZSTD_UNSET;
+    dconf->cache_dynamic = ZSTD_UNSET;
+    dconf->stream_types = NULL;
+    dconf->stream_level = ZSTD_UNSET;
+    dconf->preference[0] = ZSTD_UNSET;
+
+    return dconf;
+}
+
+#define MERGE_UNSET(field) \
+    dconf->field = (add->field != ZSTD_UNSET) ? add->field : base->field
+
+static void *merge_dir_config(apr_pool_t *p, void *basev, void *addv) {
+
+    zstd_dir_config_t *base = basev;
+    zstd_dir_config_t *add = addv;
+    zstd_dir_config_t *dconf = apr_palloc(p, sizeof(*dconf));
+
+    MERGE_UNSET(enabled);
+    MERGE_UNSET(compression_level);
+    MERGE_UNSET(workers);
+    MERGE_UNSET(workers_min_size);
+    MERGE_UNSET(etag_mode);
+    MERGE_UNSET(precompressed);
+    MERGE_UNSET(out_buffer_size);
+    MERGE_UNSET(min_length);
+    MERGE_UNSET(max_length);
+    MERGE_UNSET(probe);
+    MERGE_UNSET(window_log);
+    MERGE_UNSET(ldm);
+    MERGE_UNSET(strategy);
+    MERGE_UNSET(checksum);
+    MERGE_UNSET(target_cblock_size);
+    MERGE_UNSET(inflate_limit);
+    MERGE_UNSET(inflate_ratio);
+    MERGE_UNSET(inflate_window_log);
+    MERGE_UNSET(cache_dynamic);
+    MERGE_UNSET(stream_level);
+    dconf->stream_types = add->stream_types ? add->stream_types
+                                            : base->stream_types;
+
+    /* Settings that go by pair */
+    if (add->adaptive_min != ZSTD_UNSET) {
+        dconf->adaptive_min = add->adaptive_min;
+        dconf->adaptive_max = add->adaptive_max;
+    } else {
+        dconf->adaptive_min = base->adaptive_min;
+        dconf->adaptive_max = base->adaptive_max;
+    }
+    if (add->flush_policy != FLUSH_POLICY_UNSET) {
+        dconf->flush_policy = add->flush_policy;
+        dconf->flush_threshold = add->flush_threshold;
+    } else {
+        dconf->flush_policy = base->flush_policy;
+        dconf->flush_threshold = base->flush_threshold;
+    }
+    memcpy(dconf->preference, add->preference[0] != ZSTD_UNSET
+                              ? add->preference : base->preference,
+           sizeof(dconf->preference));
+
+    return dconf;
+}
+
+/* Fill in the defaults of what is not configured */
+static void resolve_dir_config(zstd_dir_config_t *dconf) {
+
+    if (dconf->enabled == ZSTD_UNSET) {
+        dconf->enabled = 1;
+    }
+    if (dconf->compression_level == ZSTD_UNSET) {
+        dconf->compression_level = ZSTD_DEFAULT_COMPRESSION_LEVEL;
+    }
+    if (dconf->adaptive_min == ZSTD_UNSET) {
+        dconf->adaptive_min = dconf->adaptive_max = 0;
+    }
+    if (dconf->workers == ZSTD_UNSET) {
+        dconf->workers = default_workers;
+    }
+    if (dconf->workers_min_size == ZSTD_UNSET) {
+        dconf->workers_min_size = ZSTD_DEFAULT_WORKERS_MIN_SIZE;
+    }
+    if (dconf->flush_policy == FLUSH_POLICY_UNSET) {
+        dconf->flush_policy = FLUSH_POLICY_AUTO;
+        dconf->flush_threshold = ZSTD_DEFAULT_FLUSH_IDLE_MS;
+    }
+    if (dconf->etag_mode == ETAG_MODE_UNSET) {
+        dconf->etag_mode = ETAG_MODE_ADDSUFFIX;
+    }
+    if (dconf->precompressed == ZSTD_UNSET) {
+        dconf->precompressed = 0;
+    }
+    if (dconf->out_buffer_size == ZSTD_UNSET) {
+        dconf->out_buffer_size = 0;
+    }
+    if (dconf->min_length == ZSTD_UNSET) {
+        dconf->min_length = ZSTD_DEFAULT_MIN_LENGTH;
+    }
+    if (dconf->max_length == ZSTD_UNSET) {
+        dconf->max_length = 0;
+    }
+    if (dconf->probe == ZSTD_UNSET) {
+        dconf->probe = 1;
+    }
+    /* 0 is zstd's own default for all of these */
+    if (dconf->window_log == ZSTD_UNSET) {
+        dconf->window_log = 0;
+    }
+    if (dconf->ldm == ZSTD_UNSET) {
+        dconf->ldm = 0;
+    }
+    if (dconf->strategy == ZSTD_UNSET) {
+        dconf->strategy = 0;
+    }
+    if (dconf->checksum == ZSTD_UNSET) {
+        dconf->checksum = 0;
+    }
+    if (dconf->target_cblock_size == ZSTD_UNSET) {
+        dconf->target_cblock_size = 0;
+    }
+    if (dconf->inflate_limit == ZSTD_UNSET) {
+        dconf->inflate_limit = 0;
+    }
+    if (dconf->inflate_ratio == ZSTD_UNSET) {
+        dconf->inflate_ratio = ZSTD_DEFAULT_INFLATE_RATIO;
+    }
+    if (dconf->inflate_window_log == ZSTD_UNSET) {
+        dconf->inflate_window_log = ZSTD_BROWSER_WINDOWLOG_MAX;
+    }
+    if (dconf->cache_dynamic == ZSTD_UNSET) {
+        dconf->cache_dynamic = 0;
+    }
+    /* stream_types stays NULL for ZSTD_DEFAULT_STREAM_TYPE */
+    if (dconf->stream_level == ZSTD_UNSET) {
+        dconf->stream_level = ZSTD_DEFAULT_STREAM_LEVEL;
+    }
+    if (dconf->preference[0] == ZSTD_UNSET) {
+        dconf->preference[0] = ZSTD_CODING_ZSTD;
+        dconf->preference[1] = ZSTD_CODING_BR;
+        dconf->preference[2] = ZSTD_CODING_GZIP;
+        dconf->preference[3] = ZSTD_UNSET;
+    }
+}
+
+/* The settings of the request, resolved once and kept with its context */
+static zstd_dir_config_t *get_dir_config(request_rec *r) {
+
+    zstd_dir_config_t *dconf;
+
+    dconf = apr_pmemdup(r->pool, ap_get_module_config(r->per_dir_config,
+                                                      &zstd_module),
+                        sizeof(*dconf));
+    resolve_dir_config(dconf);
+    return dconf;
+}
+
 static const char *set_filter_note(cmd_parms *cmd, void *dummy,
                                    const char *arg1, const char *arg2) {
 
     zstd_server_config_t *conf =
         ap_get_module_config(cmd->server->module_config, &zstd_module);
 
+    int i;
+
     if (!arg2) {
-        conf->note_ratio_name = arg1;
+        conf->note_names[FILTER_NOTE_RATIO] = arg1;
         return NULL;
     }
 
-    if (ap_cstr_casecmp(arg1, "Ratio") == 0) {
-        conf->note_ratio_name = arg2;
-    } else if (ap_cstr_casecmp(arg1, "Input") == 0) {
-        conf->note_input_name = arg2;
-    } else if (ap_cstr_casecmp(arg1, "Output") == 0) {
-        conf->note_output_name = arg2;
-    } else {
-        return apr_psprintf(cmd->pool, "Unknown ZstdFilterNote type '%s'",
-                            arg1);
+    for (i = 0; i < FILTER_NOTE_MAX; i++) {
+        if (ap_cstr_casecmp(arg1, filter_note_names[i]) == 0) {
+            conf->note_names[i] = arg2;
+            return NULL;
+        }
     }
 
+    return apr_psprintf(cmd->pool, "Unknown ZstdFilterNote type '%s'", arg1);
+}
+
+static const char *set_compression(cmd_parms *cmd, void *dconfv, int flag) {
+
+    zstd_dir_config_t *dconf = dconfv;
+
+    dconf->enabled = flag;
     return NULL;
 }
 
-static const char *set_compression_level(cmd_parms *cmd, void *dummy,
+static const char *set_compression_level(cmd_parms *cmd, void *dconfv,
                                          const char *arg) {
 
-    zstd_server_config_t *conf =
-        ap_get_module_config(cmd->server->module_config, &zstd_module);
+    zstd_dir_config_t *dconf = dconfv;
 
     int val = atoi(arg);
     if (val < ZSTD_minCLevel() || val > ZSTD_maxCLevel()) {
@@ -100,244 +422,3565 @@ static const char *set_compression_level(cmd_parms *cmd, void *dummy,
         );
     }
 
-    conf->compression_level = val;
+    dconf->compression_level = val;
     return NULL;
 }
 
-static const char *set_etag_mode(cmd_parms *cmd, void *dummy,
-                                 const char *arg) {
+static const char *set_workers(cmd_parms *cmd, void *dconfv,
+                               const char *arg) {
 
-    zstd_server_config_t *conf =
-        ap_get_module_config(cmd->server->module_config, &zstd_module);
+    zstd_dir_config_t *dconf = dconfv;
+    ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_nbWorkers);
 
-    if (ap_cstr_casecmp(arg, "AddSuffix") == 0) {
-        conf->etag_mode = ETAG_MODE_ADDSUFFIX;
-    } else if (ap_cstr_casecmp(arg, "NoChange") == 0) {
-        conf->etag_mode = ETAG_MODE_NOCHANGE;
-    } else if (ap_cstr_casecmp(arg, "Remove") == 0) {
-        conf->etag_mode = ETAG_MODE_REMOVE;
-    } else {
-        return "ZstdAlterETag accepts only 'AddSuffix', 'NoChange' and 'Remove'";
+    int val = atoi(arg);
+    if (val < 0 || (!ZSTD_isError(bounds.error) && val > bounds.upperBound)) {
+        return apr_psprintf(cmd->pool,
+                            "ZstdWorkers must be between 0 and %d",
+                            bounds.upperBound);
     }
 
+    dconf->workers = val;
     return NULL;
 }
 
-static apr_status_t cleanup_ctx(void *data) {
-    zstd_ctx_t *ctx = data;
-    ZSTD_freeCCtx(ctx->cctx);
-    ctx->cctx = NULL;
-    return APR_SUCCESS;
-}
+static const char *set_workers_limit(cmd_parms *cmd, void *dummy,
+                                     const char *arg) {
 
-static zstd_ctx_t *create_ctx(zstd_server_config_t* conf,
-                              apr_bucket_alloc_t *alloc,
-                              apr_pool_t *pool,
-                              request_rec* r) {
+    zstd_server_config_t *conf =
+        ap_get_module_config(cmd->server->module_config, &zstd_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err) {
+        return err;
+    }
 
-    size_t rvsp;
+    int val = atoi(arg);
+    if (val < 0) {
+        return "ZstdWorkersLimit must be 0 (no worker) or greater";
+    }
 
-    zstd_ctx_t *ctx = apr_pcalloc(pool, sizeof(*ctx));
-    ctx->cctx = ZSTD_createCCtx();
+    conf->workers_limit = val;
+    return NULL;
+}
 
-    rvsp = ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel,
-                                  conf->compression_level);
-    if (ZSTD_isError(rvsp)) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30301)
-                      "[CREATE_CTX] ZSTD_c_compressionLevel(%d): %s",
-                      conf->compression_level,
-                      ZSTD_getErrorName(rvsp));
+static const char *set_offload_threads(cmd_parms *cmd, void *dummy,
+                                       const char *arg) {
+
+    zstd_server_config_t *conf =
+        ap_get_module_config(cmd->server->module_config, &zstd_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err) {
+        return err;
     }
 
-    rvsp = ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_nbWorkers, conf->workers);
-    if (ZSTD_isError(rvsp)) {
-        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(30303)
-                      "[CREATE_CTX] ZSTD_c_nbWorkers(%d): %s",
-                      conf->workers,
-                      ZSTD_getErrorName(rvsp));
+#if ZSTD_HAS_THREAD_POOL
+    int val = atoi(arg);
+    if (val < 0) {
+        return "ZstdOffloadThreads must be 0 (disabled) or greater";
     }
 
-    apr_pool_cleanup_register(pool, ctx, cleanup_ctx, apr_pool_cleanup_null);
+    conf->offload_threads = val;
+    return NULL;
+#else
+    return "ZstdOffloadThreads needs libzstd 1.5.0 or later";
+#endif
+}
 
-    ctx->bb = apr_brigade_create(pool, alloc);
-    ctx->total_in = 0;
-    ctx->total_out = 0;
+static const char *set_workers_min_size(cmd_parms *cmd, void *dconfv,
+                                        const char *arg) {
 
-    return ctx;
+    zstd_dir_config_t *dconf = dconfv;
+    char *end;
+
+    if (apr_strtoff(&dconf->workers_min_size, arg, &end, 10) != APR_SUCCESS
+        || *end || dconf->workers_min_size < 0) {
+        return "ZstdWorkersMinSize must be a size in bytes";
+    }
+
+    return NULL;
 }
 
-static apr_status_t process_bucket(zstd_ctx_t *ctx,
-                                  ZSTD_EndDirective mode,
-                                  const void *data,
-                                  apr_size_t len,
-                                  ap_filter_t *f) {
+static const char *set_min_length(cmd_parms *cmd, void *dconfv,
+                                  const char *arg) {
 
-    size_t remaining;
+    zstd_dir_config_t *dconf = dconfv;
+    char *end;
 
-    ZSTD_inBuffer input = { data, len, 0 };
-    size_t out_size = ZSTD_compressBound(len);
-    char *out_buffer = apr_palloc(f->r->pool, out_size);
-    ZSTD_outBuffer output = { out_buffer, out_size, 0 };
+    if (apr_strtoff(&dconf->min_length, arg, &end, 10) != APR_SUCCESS
+        || *end || dconf->min_length < 0) {
+        return "ZstdMinLength must be a size in bytes";
+    }
 
-    do {
-        /*
-         * https://facebook.github.io/zstd/zstd_manual.html#Chapter8
-         * ex. https://fossies.org/linux/cyrus-imapd/imap/httpd.c
-         */
-        remaining = ZSTD_compressStream2(ctx->cctx, &output, &input, mode);
-        if (ZSTD_isError(remaining)) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, f->r, APLOGNO(30305)
-                "Error while processing bucket: %s",
-                ZSTD_getErrorName(remaining));
-            return APR_EGENERAL;
-        }
-    } while (remaining || (input.pos != input.size));
+    return NULL;
+}
+
+static const char *set_max_length(cmd_parms *cmd, void *dconfv,
+                                  const char *arg) {
+
+    zstd_dir_config_t *dconf = dconfv;
+    char *end;
 
-    if (output.pos > 0) {
-        apr_bucket *b = apr_bucket_heap_create(out_buffer, output.pos,
-                                               NULL, ctx->bb->bucket_alloc);
-        ctx->total_out += output.pos;
-        APR_BRIGADE_INSERT_TAIL(ctx->bb, b);
+    if (apr_strtoff(&dconf->max_length, arg, &end, 10) != APR_SUCCESS
+        || *end || dconf->max_length < 0) {
+        return "ZstdMaxLength must be a size in bytes (0 for no limit)";
     }
 
-    ctx->total_in += len;
+    return NULL;
+}
 
-    return APR_SUCCESS;
+static const char *set_probe(cmd_parms *cmd, void *dconfv, int flag) {
+
+    zstd_dir_config_t *dconf = dconfv;
+
+    dconf->probe = flag;
+    return NULL;
 }
 
-static const char *get_content_encoding(request_rec *r) {
+static const char *set_preference(cmd_parms *cmd, void *dconfv,
+                                  const char *arg1, const char *arg2,
+                                  const char *arg3) {
 
-    const char *encoding;
+    zstd_dir_config_t *dconf = dconfv;
+    const char *args[3];
+    int i, j, n = 0;
 
-    encoding = apr_table_get(r->headers_out, "Content-Encoding");
-    if (encoding) {
-        const char *err_enc;
-        err_enc = apr_table_get(r->err_headers_out, "Content-Encoding");
-        if (err_enc) {
-            encoding = apr_pstrcat(r->pool, encoding, ",", err_enc, NULL);
-        }
-    } else {
-        encoding = apr_table_get(r->err_headers_out, "Content-Encoding");
-    }
+    args[0] = arg1;
+    args[1] = arg2;
+    args[2] = arg3;
+    for (i = 0; i < 3 && args[i]; i++) {
+        int coding = ZSTD_UNSET;
 
-    if (r->content_encoding) {
-        encoding = encoding ? apr_pstrcat(r->pool, encoding, ",",
-                                          r->content_encoding, NULL)
-                            : r->content_encoding;
+        if (ap_cstr_casecmp(args[i], "zstd") == 0) {
+            coding = ZSTD_CODING_ZSTD;
+        } else if (ap_cstr_casecmp(args[i], "br") == 0) {
+            coding = ZSTD_CODING_BR;
+        } else if (ap_cstr_casecmp(args[i], "gzip") == 0) {
+            coding = ZSTD_CODING_GZIP;
+        }
+        for (j = 0; j < n && coding != ZSTD_UNSET; j++) {
+            if (dconf->preference[j] == coding) {
+                coding = ZSTD_UNSET;
+            }
+        }
+        if (coding == ZSTD_UNSET) {
+            return "ZstdPreference takes zstd, br and gzip, each at most once";
+        }
+        dconf->preference[n++] = coding;
     }
+    dconf->preference[n] = ZSTD_UNSET;
 
-    return encoding;
+    return NULL;
 }
 
-static apr_status_t compress_filter(ap_filter_t *f, apr_bucket_brigade *bb) {
+static const char *set_window_log(cmd_parms *cmd, void *dconfv,
+                                  const char *arg) {
 
-    request_rec *r = f->r;
-    zstd_ctx_t *ctx = f->ctx;
-    apr_status_t rv;
-    zstd_server_config_t *conf;
+    zstd_dir_config_t *dconf = dconfv;
+    ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
 
-    if (APR_BRIGADE_EMPTY(bb)) {
-        return APR_SUCCESS;
+    int val = atoi(arg);
+    if (val != 0 && (val < bounds.lowerBound
+                     || val > ZSTD_BROWSER_WINDOWLOG_MAX)) {
+        return apr_psprintf(cmd->pool,
+                            "ZstdWindowLog must be 0 (level's default) or "
+                            "between %d and %d, browsers refusing larger "
+                            "windows", bounds.lowerBound,
+                            ZSTD_BROWSER_WINDOWLOG_MAX);
     }
 
-    conf = ap_get_module_config(r->server->module_config, &zstd_module);
+    dconf->window_log = val;
+    return NULL;
+}
 
-    if (!ctx) {
-        const char *encoding;
-        const char *token;
-        const char *accepts;
-        const char *q = NULL;
+static const char *set_ldm(cmd_parms *cmd, void *dconfv, int flag) {
 
-        /* Only work on main request, not subrequests, that are not
-         * a 204 response with no content, and are not tagged with the
-         * no-zstd env variable, and are not a partial response to
-         * a Range request.
-         *
-         * Note that responding to 304 is handled separately to set
-         * the required headers (such as ETag) per RFC7232, 4.1.
-         */
-        if (r->main || r->status == HTTP_NO_CONTENT
-            || apr_table_get(r->subprocess_env, "no-zstd")
-            || apr_table_get(r->headers_out, "Content-Range")) {
-            ap_remove_output_filter(f);
-            return ap_pass_brigade(f->next, bb);
-        }
+    zstd_dir_config_t *dconf = dconfv;
 
-        /* Let's see what our current Content-Encoding is. */
-        encoding = get_content_encoding(r);
-        if (encoding) {
-            const char *tmp = encoding;
-            token = ap_get_token(r->pool, &tmp, 0);
-            while (token && *token) {
-                if (strcmp(token, "identity") != 0 &&
-                    strcmp(token, "7bit") != 0 &&
-                    strcmp(token, "8bit") != 0 &&
-                    strcmp(token, "binary") != 0) {
-                    /* The data is already encoded, do nothing. */
-                    ap_remove_output_filter(f);
-                    return ap_pass_brigade(f->next, bb);
-                }
-                if (*tmp) {
-                    ++tmp;
-                }
-                token = (*tmp) ? ap_get_token(r->pool, &tmp, 0) : NULL;
-            }
-        }
+    dconf->ldm = flag;
+    return NULL;
+}
 
-        /* Even if we don't accept this request based on it not having
-         * the Accept-Encoding, we need to note that we were looking
-         * for this header and downstream proxies should be aware of
-         * that.
-         */
-        apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
-        accepts = apr_table_get(r->headers_in, "Accept-Encoding");
-        if (!accepts) {
-            ap_remove_output_filter(f);
-            return ap_pass_brigade(f->next, bb);
-        }
+static const char *set_strategy(cmd_parms *cmd, void *dconfv,
+                                const char *arg) {
 
-        /* Do we have Accept-Encoding: zstd? */
-        token = ap_get_token(r->pool, &accepts, 0);
-        while (token && token[0] && ap_cstr_casecmp(token, "zstd") != 0) {
-            while (*accepts == ';') {
-                ++accepts;
-                ap_get_token(r->pool, &accepts, 1);
-            }
-            if (*accepts == ',') {
-                ++accepts;
-            }
-            token = (*accepts) ? ap_get_token(r->pool, &accepts, 0) : NULL;
-        }
+    zstd_dir_config_t *dconf = dconfv;
+    int i;
 
-        /* Find the qvalue, if provided */
-        if (*accepts) {
-            while (*accepts == ';') {
-                ++accepts;
-            }
-            q = ap_get_token(r->pool, &accepts, 1);
-            ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
-                          "token: '%s' - q: '%s'", token ? token : "NULL", q);
+    for (i = 0; i < (int)(sizeof(strategy_names) / sizeof(*strategy_names));
+         i++) {
+        if (ap_cstr_casecmp(arg, strategy_names[i]) == 0) {
+            dconf->strategy = i;
+            return NULL;
         }
+    }
 
-        /* No acceptable token found or q=0 */
-        if (!token || token[0] == '\0' ||
-            (q && strlen(q) >= 3 && strncmp("q=0.000", q, strlen(q)) == 0)) {
-            ap_remove_output_filter(f);
-            return ap_pass_brigade(f->next, bb);
-        }
+    return "ZstdStrategy must be 'default', 'fast', 'dfast', 'greedy', "
+           "'lazy', 'lazy2', 'btlazy2', 'btopt', 'btultra' or 'btultra2'";
+}
+
+static const char *set_checksum(cmd_parms *cmd, void *dconfv, int flag) {
+
+    zstd_dir_config_t *dconf = dconfv;
+
+    dconf->checksum = flag;
+    return NULL;
+}
+
+static const char *set_target_cblock_size(cmd_parms *cmd, void *dconfv,
+                                          const char *arg) {
+
+    zstd_dir_config_t *dconf = dconfv;
+    ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_targetCBlockSize);
+
+    int val = atoi(arg);
+    if (ZSTD_isError(bounds.error)) {
+        return "ZstdTargetCBlockSize is not supported by this libzstd";
+    }
+    if (val != 0 && (val < bounds.lowerBound || val > bounds.upperBound)) {
+        return apr_psprintf(cmd->pool,
+                            "ZstdTargetCBlockSize must be 0 (no target) or "
+                            "between %d and %d", bounds.lowerBound,
+                            bounds.upperBound);
+    }
+
+    dconf->target_cblock_size = val;
+    return NULL;
+}
+
+static const char *set_inflate_limit(cmd_parms *cmd, void *dconfv,
+                                     const char *arg) {
+
+    zstd_dir_config_t *dconf = dconfv;
+    char *end;
+
+    if (apr_strtoff(&dconf->inflate_limit, arg, &end, 10) != APR_SUCCESS
+        || *end || dconf->inflate_limit < 0) {
+        return "ZstdMaxInflateLimit must be a size in bytes";
+    }
+
+    return NULL;
+}
+
+static const char *set_inflate_ratio(cmd_parms *cmd, void *dconfv,
+                                     const char *arg) {
+
+    zstd_dir_config_t *dconf = dconfv;
+
+    int val = atoi(arg);
+    if (val < 0) {
+        return "ZstdMaxInflateRatio must be 0 (no limit) or greater";
+    }
+
+    dconf->inflate_ratio = val;
+    return NULL;
+}
+
+static const char *set_inflate_window_log(cmd_parms *cmd, void *dconfv,
+                                          const char *arg) {
+
+    zstd_dir_config_t *dconf = dconfv;
+    ZSTD_bounds bounds = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+
+    int val = atoi(arg);
+    if (val < bounds.lowerBound || val > bounds.upperBound) {
+        return apr_psprintf(cmd->pool,
+                            "ZstdMaxInflateWindowLog must be between %d and "
+                            "%d", bounds.lowerBound, bounds.upperBound);
+    }
+
+    dconf->inflate_window_log = val;
+    return NULL;
+}
+
+static const char *set_precompressed(cmd_parms *cmd, void *dconfv, int flag) {
+
+    zstd_dir_config_t *dconf = dconfv;
+
+    dconf->precompressed = flag;
+    return NULL;
+}
+
+static const char *set_cache_root(cmd_parms *cmd, void *dummy,
+                                  const char *arg) {
+
+    zstd_server_config_t *conf =
+        ap_get_module_config(cmd->server->module_config, &zstd_module);
+
+#if APR_HAS_THREADS
+    conf->cache_root = ap_server_root_relative(cmd->pool, arg);
+    if (!conf->cache_root) {
+        return apr_pstrcat(cmd->pool, "Invalid ZstdCacheRoot path ", arg,
+                           NULL);
+    }
+    return NULL;
+#else
+    return "ZstdCacheRoot requires APR with threads support";
+#endif
+}
+
+static const char *set_cache_level(cmd_parms *cmd, void *dummy,
+                                   const char *arg) {
+
+    zstd_server_config_t *conf =
+        ap_get_module_config(cmd->server->module_config, &zstd_module);
+
+    int val = atoi(arg);
+    if (val < 1 || val > ZSTD_maxCLevel()) {
+        return apr_psprintf(cmd->pool,
+                            "ZstdCacheLevel must be between 1 and %d",
+                            ZSTD_maxCLevel());
+    }
+
+    conf->cache_level = val;
+    return NULL;
+}
+
+static const char *set_cache_frame_size(cmd_parms *cmd, void *dummy,
+                                        const char *arg) {
+
+    zstd_server_config_t *conf =
+        ap_get_module_config(cmd->server->module_config, &zstd_module);
+    apr_off_t val;
+    char *end;
+
+    if (apr_strtoff(&val, arg, &end, 10) != APR_SUCCESS || *end
+        || (val != 0 && val < ZSTD_MIN_CACHE_FRAME_SIZE)
+        || val > ZSTD_MAX_CACHE_FRAME_SIZE) {
+        return apr_psprintf(cmd->pool, "ZstdCacheFrameSize must be 0 "
+                            "(default) or between %d and %d",
+                            ZSTD_MIN_CACHE_FRAME_SIZE,
+                            ZSTD_MAX_CACHE_FRAME_SIZE);
+    }
+
+    conf->cache_frame_size = val;
+    return NULL;
+}
+
+static const char *set_cache_max_size(cmd_parms *cmd, void *dummy,
+                                      const char *arg) {
+
+    zstd_server_config_t *conf =
+        ap_get_module_config(cmd->server->module_config, &zstd_module);
+    apr_off_t val;
+    char *end;
+
+    if (apr_strtoff(&val, arg, &end, 10) != APR_SUCCESS || *end || val < 0) {
+        return "ZstdCacheMaxSize must be 0 (no limit) or a number of bytes";
+    }
+
+    conf->cache_max_size = val;
+    return NULL;
+}
+
+static const char *set_cache_dynamic(cmd_parms *cmd, void *dconfv, int flag) {
+
+    zstd_dir_config_t *dconf = dconfv;
+
+#if !APR_HAS_THREADS
+    if (flag) {
+        return "ZstdCacheDynamic requires APR thread support";
+    }
+#endif
+    dconf->cache_dynamic = flag;
+    return NULL;
+}
+
+static const char *set_stream_types(cmd_parms *cmd, void *dconfv,
+                                    const char *arg) {
+
+    zstd_dir_config_t *dconf = dconfv;
+
+    if (!dconf->stream_types) {
+        dconf->stream_types = apr_array_make(cmd->pool, 2,
+                                             sizeof(const char *));
+    }
+    /* "none" alone leaves the list empty */
+    if (ap_cstr_casecmp(arg, "none") != 0) {
+        APR_ARRAY_PUSH(dconf->stream_types, const char *) = arg;
+    }
+    return NULL;
+}
+
+static const char *set_stream_level(cmd_parms *cmd, void *dconfv,
+                                    const char *arg) {
+
+    zstd_dir_config_t *dconf = dconfv;
+
+    int val = atoi(arg);
+    if (val < ZSTD_minCLevel() || val > ZSTD_maxCLevel()) {
+        return apr_psprintf(cmd->pool,
+                            "ZstdStreamLevel must be between %d and %d",
+                            ZSTD_minCLevel(), ZSTD_maxCLevel());
+    }
+
+    dconf->stream_level = val;
+    return NULL;
+}
+
+static const char *set_dictionary(cmd_parms *cmd, void *dummy,
+                                  const char *path, const char *id,
+                                  const char *match) {
+
+    zstd_server_config_t *conf =
+        ap_get_module_config(cmd->server->module_config, &zstd_module);
+    zstd_dict_t *dict;
+
+    if (!conf->dictionaries) {
+        conf->dictionaries = apr_array_make(cmd->pool, 1, sizeof(*dict));
+    }
+    dict = apr_array_push(conf->dictionaries);
+    memset(dict, 0, sizeof(*dict));
+
+    dict->path = ap_server_root_relative(cmd->pool, path);
+    if (!dict->path) {
+        return apr_pstrcat(cmd->pool, "Invalid ZstdDictionary path ", path,
+                           NULL);
+    }
+    if (strchr(id, '"') || strchr(id, '\\')
+        || (match && (strchr(match, '"') || strchr(match, '\\')))) {
+        return "ZstdDictionary id and match must not contain quotes";
+    }
+    dict->id = id;
+    dict->match = match;
+
+    return NULL;
+}
+
+static const char *set_adaptive_level(cmd_parms *cmd, void *dconfv,
+                                      const char *arg1, const char *arg2) {
+
+    zstd_dir_config_t *dconf = dconfv;
+    int min, max;
+
+    if (!arg2) {
+        if (ap_cstr_casecmp(arg1, "Off") != 0) {
+            return "ZstdAdaptiveLevel takes a minimum and a maximum level, "
+                   "or 'Off'";
+        }
+        dconf->adaptive_min = dconf->adaptive_max = 0;
+        return NULL;
+    }
+
+    min = atoi(arg1);
+    max = atoi(arg2);
+    if (min < 1 || max > ZSTD_maxCLevel() || min > max) {
+        return apr_psprintf(cmd->pool, "ZstdAdaptiveLevel levels must be "
+                            "between 1 and %d, minimum first",
+                            ZSTD_maxCLevel());
+    }
+
+    dconf->adaptive_min = min;
+    dconf->adaptive_max = max;
+    return NULL;
+}
+
+static const char *set_etag_mode(cmd_parms *cmd, void *dconfv,
+                                 const char *arg) {
+
+    zstd_dir_config_t *dconf = dconfv;
+
+    if (ap_cstr_casecmp(arg, "AddSuffix") == 0) {
+        dconf->etag_mode = ETAG_MODE_ADDSUFFIX;
+    } else if (ap_cstr_casecmp(arg, "NoChange") == 0) {
+        dconf->etag_mode = ETAG_MODE_NOCHANGE;
+    } else if (ap_cstr_casecmp(arg, "Remove") == 0) {
+        dconf->etag_mode = ETAG_MODE_REMOVE;
+    } else {
+        return "ZstdAlterETag accepts only 'AddSuffix', 'NoChange' and 'Remove'";
+    }
+
+    return NULL;
+}
+
+static const char *set_flush_policy(cmd_parms *cmd, void *dconfv,
+                                    const char *arg) {
+
+    zstd_dir_config_t *dconf = dconfv;
+    const char *num = NULL;
+    char *end;
+
+    if (ap_cstr_casecmp(arg, "auto") == 0) {
+        dconf->flush_policy = FLUSH_POLICY_AUTO;
+        dconf->flush_threshold = ZSTD_DEFAULT_FLUSH_IDLE_MS;
+        return NULL;
+    } else if (ap_cstr_casecmp(arg, "bucket") == 0) {
+        dconf->flush_policy = FLUSH_POLICY_BUCKET;
+        return NULL;
+    } else if (ap_cstr_casecmp(arg, "eos") == 0) {
+        dconf->flush_policy = FLUSH_POLICY_EOS;
+        return NULL;
+    } else if (ap_cstr_casecmpn(arg, "bytes=", 6) == 0) {
+        dconf->flush_policy = FLUSH_POLICY_BYTES;
+        num = arg + 6;
+    } else if (ap_cstr_casecmpn(arg, "ms=", 3) == 0) {
+        dconf->flush_policy = FLUSH_POLICY_MS;
+        num = arg + 3;
+    } else {
+        return "ZstdFlushPolicy accepts only 'auto', 'bucket', 'eos', "
+               "'bytes=N' and 'ms=N'";
+    }
+
+    if (apr_strtoff(&dconf->flush_threshold, num, &end, 10) != APR_SUCCESS
+        || *end || dconf->flush_threshold <= 0) {
+        return apr_psprintf(cmd->pool, "Invalid ZstdFlushPolicy value '%s'",
+                            arg);
+    }
+
+    return NULL;
+}
+
+static const char *set_output_buffer_size(cmd_parms *cmd, void *dconfv,
+                                          const char *arg) {
+
+    zstd_dir_config_t *dconf = dconfv;
+    apr_off_t val;
+    char *end;
+
+    if (apr_strtoff(&val, arg, &end, 10) != APR_SUCCESS || *end
+        || (val != 0 && val < ZSTD_MIN_OUTPUT_BUFFER_SIZE)
+        || val > ZSTD_BLOCKSIZE_MAX * 8) {
+        return apr_psprintf(cmd->pool, "ZstdOutputBufferSize must be 0 "
+                            "(default) or between %d and %d",
+                            ZSTD_MIN_OUTPUT_BUFFER_SIZE,
+                            ZSTD_BLOCKSIZE_MAX * 8);
+    }
+
+    dconf->out_buffer_size = (int)val;
+    return NULL;
+}
+
+static const char *set_cctx_pool_size(cmd_parms *cmd, void *dummy,
+                                      const char *arg) {
+
+    zstd_server_config_t *conf =
+        ap_get_module_config(cmd->server->module_config, &zstd_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err) {
+        return err;
+    }
+
+    int val = atoi(arg);
+    if (val < 0) {
+        return "ZstdContextPoolSize must be 0 (disabled) or greater";
+    }
+
+    conf->cctx_pool_size = val;
+    return NULL;
+}
+
+static const char *set_cctx_prewarm(cmd_parms *cmd, void *dummy,
+                                    const char *arg) {
+
+    zstd_server_config_t *conf =
+        ap_get_module_config(cmd->server->module_config, &zstd_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err) {
+        return err;
+    }
+
+    int val = atoi(arg);
+    if (val < 0) {
+        return "ZstdContextPrewarm must be 0 (disabled) or greater";
+    }
+
+    conf->cctx_prewarm = val;
+    return NULL;
+}
+
+static const char *set_max_memory(cmd_parms *cmd, void *dummy,
+                                  const char *arg) {
+
+    zstd_server_config_t *conf =
+        ap_get_module_config(cmd->server->module_config, &zstd_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t val;
+    char *end;
+
+    if (err) {
+        return err;
+    }
+    if (apr_strtoff(&val, arg, &end, 10) != APR_SUCCESS || *end || val < 0) {
+        return "ZstdMaxMemory must be 0 (no limit) or a number of bytes";
+    }
+
+    conf->max_memory = val;
+    return NULL;
+}
+
+static int set_cparam(ZSTD_CCtx *cctx, ZSTD_cParameter param,
+                      const char *name, int value, request_rec *r) {
+
+    size_t rvsp = ZSTD_CCtx_setParameter(cctx, param, value);
+
+    if (ZSTD_isError(rvsp)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30325)
+                      "[CREATE_CTX] %s(%d): %s", name, value,
+                      ZSTD_getErrorName(rvsp));
+        return 0;
+    }
+
+    return 1;
+}
+
+static int cparams_equal(const zstd_cparams_t *a, const zstd_cparams_t *b) {
+    return a->compression_level == b->compression_level
+           && a->workers == b->workers
+           && a->window_log == b->window_log
+           && a->ldm == b->ldm
+           && a->strategy == b->strategy
+           && a->checksum == b->checksum
+           && a->target_cblock_size == b->target_cblock_size
+           && a->cdict == b->cdict;
+}
+
+/*
+ * The window log to use: the configured one, or else 0 (the level's)
+ * unless that would exceed what browsers decode, as levels above 19 and
+ * long distance matching do.
+ */
+static int browser_window_log(int level, int window_log, int ldm) {
+
+    if (window_log) {
+        return window_log;
+    }
+    if (!experimental_api) {
+        /* The levels above 19 are those of larger windows */
+        return ldm || level > 19 ? ZSTD_BROWSER_WINDOWLOG_MAX : 0;
+    }
+    if (ldm || ZSTD_getCParams(level, ZSTD_CONTENTSIZE_UNKNOWN, 0).windowLog
+                   > ZSTD_BROWSER_WINDOWLOG_MAX) {
+        return ZSTD_BROWSER_WINDOWLOG_MAX;
+    }
+
+    return 0;
+}
+
+/* ZSTD_STREAM_TARGET_CBLOCK_SIZE within what this libzstd takes, if any */
+static int stream_cblock_size(void) {
+
+    ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_targetCBlockSize);
+
+    if (ZSTD_isError(bounds.error)) {
+        return 0;
+    }
+    if (ZSTD_STREAM_TARGET_CBLOCK_SIZE < bounds.lowerBound) {
+        return bounds.lowerBound;
+    }
+    return ZSTD_STREAM_TARGET_CBLOCK_SIZE;
+}
+
+static int apply_cparams(ZSTD_CCtx *cctx, const zstd_cparams_t *params,
+                         request_rec *r) {
+
+    size_t rvsp;
+
+    rvsp = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                  params->compression_level);
+    if (ZSTD_isError(rvsp)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30301)
+                      "[CREATE_CTX] ZSTD_c_compressionLevel(%d): %s",
+                      params->compression_level,
+                      ZSTD_getErrorName(rvsp));
+        return 0;
+    }
+
+    rvsp = ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, params->workers);
+    if (ZSTD_isError(rvsp)) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(30303)
+                      "[CREATE_CTX] ZSTD_c_nbWorkers(%d): %s",
+                      params->workers,
+                      ZSTD_getErrorName(rvsp));
+    }
+
+#if ZSTD_HAS_THREAD_POOL
+    /* All multi-threaded contexts of the process share the offload pool,
+     * which outlives them (see zstd_child_init()).
+     */
+    if (params->workers > 0 && offload_pool) {
+        rvsp = ZSTD_CCtx_refThreadPool(cctx, offload_pool);
+        if (ZSTD_isError(rvsp)) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30341)
+                          "[CREATE_CTX] ZSTD_CCtx_refThreadPool: %s",
+                          ZSTD_getErrorName(rvsp));
+            return 0;
+        }
+    }
+#endif
+
+    if (!set_cparam(cctx, ZSTD_c_windowLog, "ZSTD_c_windowLog",
+                    params->window_log, r)
+        || !set_cparam(cctx, ZSTD_c_enableLongDistanceMatching,
+                       "ZSTD_c_enableLongDistanceMatching", params->ldm, r)
+        || !set_cparam(cctx, ZSTD_c_strategy, "ZSTD_c_strategy",
+                       params->strategy, r)
+        || !set_cparam(cctx, ZSTD_c_checksumFlag, "ZSTD_c_checksumFlag",
+                       params->checksum, r)
+        || ((experimental_api || ZSTD_HAS_STABLE_CBLOCK_SIZE)
+            && !set_cparam(cctx, ZSTD_c_targetCBlockSize,
+                           "ZSTD_c_targetCBlockSize",
+                           params->target_cblock_size, r))) {
+        return 0;
+    }
+
+    rvsp = ZSTD_CCtx_refCDict(cctx, params->cdict);
+    if (ZSTD_isError(rvsp)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30321)
+                      "[CREATE_CTX] ZSTD_CCtx_refCDict: %s",
+                      ZSTD_getErrorName(rvsp));
+        return 0;
+    }
+
+    return 1;
+}
+
+/* The parameters but workers and dictionary, as zstd's own structure */
+static ZSTD_CCtx_params *cctx_params_create(const zstd_cparams_t *params) {
+
+    ZSTD_CCtx_params *cp = ZSTD_createCCtxParams();
+
+    if (!cp) {
+        return NULL;
+    }
+    if (ZSTD_isError(ZSTD_CCtxParams_init(cp, params->compression_level))
+        || ZSTD_isError(ZSTD_CCtxParams_setParameter(cp, ZSTD_c_windowLog,
+                                                     params->window_log))
+        || ZSTD_isError(ZSTD_CCtxParams_setParameter(cp,
+                            ZSTD_c_enableLongDistanceMatching, params->ldm))
+        || ZSTD_isError(ZSTD_CCtxParams_setParameter(cp, ZSTD_c_strategy,
+                                                     params->strategy))
+        || ZSTD_isError(ZSTD_CCtxParams_setParameter(cp, ZSTD_c_checksumFlag,
+                                                     params->checksum))
+        || ((experimental_api || ZSTD_HAS_STABLE_CBLOCK_SIZE)
+            && ZSTD_isError(ZSTD_CCtxParams_setParameter(cp,
+                                ZSTD_c_targetCBlockSize,
+                                params->target_cblock_size)))) {
+        ZSTD_freeCCtxParams(cp);
+        return NULL;
+    }
+    return cp;
+}
+
+/*
+ * ZstdMaxMemory: what a context takes once streaming, as zstd estimates
+ * it, and about as much again per worker thread.
+ */
+static apr_size_t cctx_estimate(const zstd_cparams_t *params) {
+
+    ZSTD_CCtx_params *cp = cctx_params_create(params);
+    size_t size;
+
+    if (!cp) {
+        return 0;
+    }
+    size = ZSTD_estimateCStreamSize_usingCCtxParams(cp);
+    ZSTD_freeCCtxParams(cp);
+    if (ZSTD_isError(size)) {
+        return 0;
+    }
+    return size * (1 + (params->workers > 0 ? params->workers : 0));
+}
+
+static int memory_reserve(apr_size_t size) {
+
+    apr_uint64_t used;
+
+    do {
+        used = apr_atomic_read64(&memory_used);
+        if (used + size > memory_limit) {
+            return 0;
+        }
+    } while (apr_atomic_cas64(&memory_used, used + size, used) != used);
+
+    return 1;
+}
+
+static void memory_release(apr_size_t size) {
+    if (size > 0) {
+        apr_atomic_sub64(&memory_used, size);
+    }
+}
+
+/*
+ * Take an idle context out of the pool. An exact parameter match is
+ * preferred; otherwise a context with the same number of workers is
+ * reconfigured, as changing ZSTD_c_nbWorkers would drop its thread pool
+ * and the point of reusing it. Returns NULL when nothing fits; otherwise
+ * the memory reserved for it is released, the caller having its own.
+ */
+static ZSTD_CCtx *cctx_pool_get(const zstd_cparams_t *params, request_rec *r) {
+
+    ZSTD_CCtx *cctx = NULL;
+    int i, found = -1;
+
+    if (!cctx_pool || !cctx_pool->max_idle) {
+        return NULL;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cctx_pool->mutex);
+#endif
+    for (i = cctx_pool->nidle - 1; i >= 0; i--) {
+        const zstd_cparams_t *p = &cctx_pool->idle[i].params;
+        if (cparams_equal(p, params)) {
+            found = i;
+            break;
+        }
+        if (found < 0 && p->workers == params->workers) {
+            found = i;
+        }
+    }
+    if (found >= 0) {
+        zstd_pooled_cctx_t slot = cctx_pool->idle[found];
+
+        /* Kept oldest first, for cctx_pool_trim() */
+        memmove(&cctx_pool->idle[found], &cctx_pool->idle[found + 1],
+                (--cctx_pool->nidle - found) * sizeof(slot));
+        memory_release(slot.reserved);
+        cctx = slot.cctx;
+        if (!cparams_equal(&slot.params, params)
+            && !apply_cparams(cctx, params, r)) {
+            ZSTD_freeCCtx(cctx);
+            cctx = NULL;
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cctx_pool->mutex);
+#endif
+
+    return cctx;
+}
+
+/*
+ * Give a context back to the pool once its frame is done (or abandoned).
+ * Only the session is reset, so parameters survive for the next request,
+ * and so does the memory reserved for it.
+ */
+static void cctx_pool_put(ZSTD_CCtx *cctx, const zstd_cparams_t *params,
+                          apr_size_t reserved) {
+
+    if (cctx_pool && cctx_pool->max_idle
+        && !ZSTD_isError(ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only))) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(cctx_pool->mutex);
+#endif
+        if (cctx_pool->nidle < cctx_pool->max_idle) {
+            cctx_pool->idle[cctx_pool->nidle].cctx = cctx;
+            cctx_pool->idle[cctx_pool->nidle].params = *params;
+            cctx_pool->idle[cctx_pool->nidle].reserved = reserved;
+            cctx_pool->nidle++;
+            cctx = NULL;
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(cctx_pool->mutex);
+#endif
+    }
+
+    if (cctx) {
+        ZSTD_freeCCtx(cctx);
+        memory_release(reserved);
+    }
+}
+
+/*
+ * ZstdMaxMemory: free the oldest idle contexts until size fits in the
+ * budget. Returns 0 when there is nothing left to free.
+ */
+static int cctx_pool_trim(apr_size_t size) {
+
+    int freed = 0;
+
+    if (!cctx_pool) {
+        return 0;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cctx_pool->mutex);
+#endif
+    while (cctx_pool->nidle > 0
+           && apr_atomic_read64(&memory_used) + size > memory_limit) {
+        zstd_pooled_cctx_t *slot = &cctx_pool->idle[0];
+
+        ZSTD_freeCCtx(slot->cctx);
+        memory_release(slot->reserved);
+        memmove(slot, slot + 1, --cctx_pool->nidle * sizeof(*slot));
+        freed++;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cctx_pool->mutex);
+#endif
+
+    return freed > 0;
+}
+
+/*
+ * ZstdContextPrewarm: fill the pool with contexts configured as responses
+ * of the main server want them, their tables already allocated, so that
+ * the first requests of a (gracefully) restarted child do not pay for it.
+ */
+static void cctx_pool_prewarm(server_rec *s, int n) {
+
+    zstd_dir_config_t dconf = *(zstd_dir_config_t *)
+        ap_get_module_config(s->lookup_defaults, &zstd_module);
+    zstd_cparams_t params;
+    ZSTD_CCtx_params *cp;
+    int i;
+
+    resolve_dir_config(&dconf);
+    memset(&params, 0, sizeof(params));
+    params.compression_level = dconf.adaptive_max ? dconf.adaptive_max
+                                                  : dconf.compression_level;
+    params.window_log = browser_window_log(params.compression_level,
+                                           dconf.window_log, dconf.ldm);
+    params.ldm = dconf.ldm;
+    params.strategy = dconf.strategy;
+    params.checksum = dconf.checksum;
+    params.target_cblock_size = dconf.target_cblock_size;
+
+    cp = cctx_params_create(&params);
+    if (!cp) {
+        return;
+    }
+    for (i = 0; i < n && i < cctx_pool->max_idle; i++) {
+        apr_size_t reserved = memory_limit ? cctx_estimate(&params) : 0;
+        char header[ZSTD_FRAMEHEADERSIZE_MAX];
+        ZSTD_inBuffer input = { NULL, 0, 0 };
+        ZSTD_outBuffer output = { header, sizeof(header), 0 };
+        ZSTD_CCtx *cctx;
+
+        if (reserved && !memory_reserve(reserved)) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(30349)
+                         "ZstdMaxMemory leaves room for %d of the %d "
+                         "contexts of ZstdContextPrewarm", i, n);
+            break;
+        }
+        /* Streaming starts with the tables of a frame of unknown size */
+        cctx = ZSTD_createCCtx();
+        if (!cctx
+            || ZSTD_isError(ZSTD_CCtx_setParametersUsingCCtxParams(cctx, cp))
+            || ZSTD_isError(ZSTD_compressStream2(cctx, &output, &input,
+                                                 ZSTD_e_flush))) {
+            ZSTD_freeCCtx(cctx);
+            memory_release(reserved);
+            break;
+        }
+        cctx_pool_put(cctx, &params, reserved);
+    }
+    ZSTD_freeCCtxParams(cp);
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "prewarmed %d compression contexts at level %d", i,
+                 params.compression_level);
+}
+
+static apr_status_t cleanup_cctx_pool(void *data) {
+
+    zstd_cctx_pool_t *pool = data;
+
+    while (pool->nidle > 0) {
+        ZSTD_freeCCtx(pool->idle[--pool->nidle].cctx);
+    }
+    cctx_pool = NULL;
+    return APR_SUCCESS;
+}
+
+#if ZSTD_HAS_THREAD_POOL
+static apr_status_t cleanup_offload_pool(void *data) {
+
+    ZSTD_freeThreadPool(data);
+    offload_pool = NULL;
+    return APR_SUCCESS;
+}
+#endif
+
+/*
+ * Take a decompression context, from the pool or new, accepting windows
+ * up to ZstdMaxInflateWindowLog. Decompression contexts have no other
+ * parameter that would tell them apart.
+ */
+static ZSTD_DCtx *dctx_pool_get(const zstd_dir_config_t *dconf,
+                                request_rec *r) {
+
+    ZSTD_DCtx *dctx = NULL;
+    size_t rvsp;
+
+    if (dctx_pool && dctx_pool->max_idle) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(dctx_pool->mutex);
+#endif
+        if (dctx_pool->nidle > 0) {
+            dctx = dctx_pool->idle[--dctx_pool->nidle];
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(dctx_pool->mutex);
+#endif
+    }
+    if (!dctx && !(dctx = ZSTD_createDCtx())) {
+        return NULL;
+    }
+
+    rvsp = ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax,
+                                  dconf->inflate_window_log);
+    if (ZSTD_isError(rvsp)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30331)
+                      "ZSTD_d_windowLogMax(%d): %s",
+                      dconf->inflate_window_log, ZSTD_getErrorName(rvsp));
+        ZSTD_freeDCtx(dctx);
+        return NULL;
+    }
+
+    return dctx;
+}
+
+static void dctx_pool_put(ZSTD_DCtx *dctx) {
+
+    if (dctx_pool && dctx_pool->max_idle
+        && !ZSTD_isError(ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only))) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(dctx_pool->mutex);
+#endif
+        if (dctx_pool->nidle < dctx_pool->max_idle) {
+            dctx_pool->idle[dctx_pool->nidle++] = dctx;
+            dctx = NULL;
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(dctx_pool->mutex);
+#endif
+    }
+
+    ZSTD_freeDCtx(dctx);
+}
+
+static apr_status_t cleanup_dctx_pool(void *data) {
+
+    zstd_dctx_pool_t *pool = data;
+
+    while (pool->nidle > 0) {
+        ZSTD_freeDCtx(pool->idle[--pool->nidle]);
+    }
+    dctx_pool = NULL;
+    return APR_SUCCESS;
+}
+
+/*
+ * SHA-256 (FIPS 180-4), which dictionaries are identified by in the
+ * Compression Dictionary Transport headers. Only used at startup.
+ */
+static const apr_uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(apr_uint32_t h[8], const unsigned char *p) {
+
+    apr_uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (apr_uint32_t)p[i * 4] << 24 | (apr_uint32_t)p[i * 4 + 1] << 16
+               | (apr_uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        t1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19)
+             ^ (w[i - 2] >> 10);
+        t2 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18)
+             ^ (w[i - 15] >> 3);
+        w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; k = h[7];
+    for (i = 0; i < 64; i++) {
+        t1 = k + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25))
+             + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22))
+             + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256(const unsigned char *data, apr_size_t len,
+                   unsigned char digest[ZSTD_SHA256_LEN]) {
+
+    apr_uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    unsigned char tail[128];
+    apr_uint64_t bits = (apr_uint64_t)len * 8;
+    apr_size_t i, rest = len % 64, tail_len = (rest < 56) ? 64 : 128;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        sha256_block(h, data + i);
+    }
+
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + len - rest, rest);
+    tail[rest] = 0x80;
+    for (i = 0; i < 8; i++) {
+        tail[tail_len - 1 - i] = (unsigned char)(bits >> (i * 8));
+    }
+    sha256_block(h, tail);
+    if (tail_len == 128) {
+        sha256_block(h, tail + 64);
+    }
+
+    for (i = 0; i < 8; i++) {
+        digest[i * 4] = (unsigned char)(h[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(h[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(h[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)h[i];
+    }
+}
+
+static apr_status_t cleanup_cdict(void *data) {
+    ZSTD_freeCDict(data);
+    return APR_SUCCESS;
+}
+
+/*
+ * Load a dictionary and digest it once, at the configured level, so that
+ * responses only reference it. Children share it copy-on-write.
+ */
+static apr_status_t load_dictionary(zstd_dict_t *dict, int level,
+                                    apr_pool_t *p, server_rec *s) {
+
+    apr_finfo_t finfo;
+    apr_file_t *fd;
+    apr_size_t len;
+    char *data, *b64;
+    apr_status_t rv;
+
+    rv = apr_file_open(&fd, dict->path, APR_FOPEN_READ | APR_FOPEN_BINARY,
+                       APR_FPROT_OS_DEFAULT, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, fd);
+        if (rv == APR_SUCCESS) {
+            len = (apr_size_t)finfo.size;
+            data = apr_palloc(p, len + 1);
+            rv = apr_file_read_full(fd, data, len, NULL);
+        }
+        apr_file_close(fd);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(30317)
+                     "Failed to read ZstdDictionary %s", dict->path);
+        return rv;
+    }
+
+    /* Browsers use the dictionary as raw content, whatever it starts with.
+     * ZSTD_createCDict() takes it so too, unless it starts as a zstd one.
+     */
+    if (experimental_api) {
+        dict->cdict = ZSTD_createCDict_advanced(data, len, ZSTD_dlm_byCopy,
+                                                ZSTD_dct_rawContent,
+                                                ZSTD_getCParams(level, 0, len),
+                                                ZSTD_defaultCMem);
+    } else if (ZSTD_getDictID_fromDict(data, len)) {
+        /* Left out: responses are compressed without it */
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(30355)
+                     "ZstdDictionary %s is a zstd dictionary, which only "
+                     "the zstd %s built against takes as raw content: "
+                     "ignored", dict->path, ZSTD_VERSION_STRING);
+        return APR_SUCCESS;
+    } else {
+        dict->cdict = ZSTD_createCDict(data, len, level);
+    }
+    if (!dict->cdict) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(30319)
+                     "Failed to digest ZstdDictionary %s", dict->path);
+        return APR_EGENERAL;
+    }
+    apr_pool_cleanup_register(p, dict->cdict, cleanup_cdict,
+                              apr_pool_cleanup_null);
+
+    sha256((const unsigned char *)data, len, dict->sha256);
+    b64 = apr_palloc(p, apr_base64_encode_len(ZSTD_SHA256_LEN));
+    apr_base64_encode(b64, (const char *)dict->sha256, ZSTD_SHA256_LEN);
+    dict->hash = apr_pstrcat(p, ":", b64, ":", NULL);
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "loaded ZstdDictionary %s (%" APR_SIZE_T_FMT " bytes, "
+                 "id \"%s\", sha-256 %s)", dict->path, len, dict->id,
+                 dict->hash);
+    return APR_SUCCESS;
+}
+
+/*
+ * The dictionary the client has (Available-Dictionary) if it is one of
+ * ours, for a "dcz" response.
+ */
+static const zstd_dict_t *find_dictionary(request_rec *r,
+                                          zstd_server_config_t *conf) {
+
+    const char *available;
+    int i;
+
+    available = apr_table_get(r->headers_in, "Available-Dictionary");
+    if (!available) {
+        return NULL;
+    }
+    while (apr_isspace(*available)) {
+        available++;
+    }
+
+    for (i = 0; i < conf->dictionaries->nelts; i++) {
+        const zstd_dict_t *dict =
+            &APR_ARRAY_IDX(conf->dictionaries, i, zstd_dict_t);
+        apr_size_t len = strlen(dict->hash);
+
+        if (dict->cdict && strncmp(available, dict->hash, len) == 0
+            && (!available[len] || apr_isspace(available[len]))) {
+            return dict;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Advertise the dictionary when the dictionary file itself is served, so
+ * that clients keep it for the URLs it matches.
+ */
+static void advertise_dictionary(request_rec *r, zstd_server_config_t *conf) {
+
+    int i;
+
+    if (!r->filename || r->finfo.filetype != APR_REG) {
+        return;
+    }
+
+    for (i = 0; i < conf->dictionaries->nelts; i++) {
+        const zstd_dict_t *dict =
+            &APR_ARRAY_IDX(conf->dictionaries, i, zstd_dict_t);
+
+        if (dict->match && strcmp(r->filename, dict->path) == 0) {
+            apr_table_setn(r->headers_out, "Use-As-Dictionary",
+                           apr_psprintf(r->pool, "match=\"%s\", id=\"%s\"",
+                                        dict->match, dict->id));
+            return;
+        }
+    }
+}
+
+/* CPU time consumed by the calling thread, in microseconds */
+static apr_int64_t thread_cpu_usec(void) {
+
+#ifdef _WIN32
+    FILETIME creation, exited, kernel, user;
+    ULARGE_INTEGER k, u;
+
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exited, &kernel,
+                        &user)) {
+        return 0;
+    }
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (apr_int64_t)((k.QuadPart + u.QuadPart) / 10);
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return (apr_int64_t)ts.tv_sec * APR_USEC_PER_SEC + ts.tv_nsec / 1000;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * The CPU time of a response is sampled per brigade, which costs a system
+ * call where a clock read per bucket would cost two, and with the time
+ * spent passing output downstream (SSL included) left out.
+ */
+static void cpu_sample_start(zstd_ctx_t *ctx) {
+    ctx->cpu_mark = thread_cpu_usec();
+}
+
+static void cpu_sample_stop(zstd_ctx_t *ctx) {
+    if (ctx->cpu_mark) {
+        ctx->cpu_usec += thread_cpu_usec() - ctx->cpu_mark;
+        ctx->cpu_mark = 0;
+    }
+}
+
+/* Does the media type (without parameters) match exactly? */
+static int is_type(const char *type, const char *expected) {
+
+    apr_size_t len = strlen(expected);
+
+    return ap_cstr_casecmpn(type, expected, len) == 0
+           && (!type[len] || type[len] == ';' || apr_isspace(type[len]));
+}
+
+static zstd_type_e stats_type(const char *type) {
+
+    const char *sub, *end;
+
+    if (!type) {
+        return ZSTD_TYPE_OTHER;
+    }
+    if (is_type(type, "text/html") || is_type(type, "application/xhtml+xml")) {
+        return ZSTD_TYPE_HTML;
+    }
+    if (is_type(type, "text/css")) {
+        return ZSTD_TYPE_CSS;
+    }
+    if (is_type(type, "text/javascript")
+        || is_type(type, "application/javascript")
+        || is_type(type, "application/x-javascript")) {
+        return ZSTD_TYPE_JAVASCRIPT;
+    }
+    if (is_type(type, "image/svg+xml")) {
+        return ZSTD_TYPE_SVG;
+    }
+
+    /* Structured syntax suffixes (RFC 6839) */
+    end = type + strcspn(type, "; \t");
+    sub = end;
+    while (sub > type && sub[-1] != '+' && sub[-1] != '/') {
+        sub--;
+    }
+    if (end - sub == 4 && ap_cstr_casecmpn(sub, "json", 4) == 0) {
+        return ZSTD_TYPE_JSON;
+    }
+    if (end - sub == 3 && ap_cstr_casecmpn(sub, "xml", 3) == 0) {
+        return ZSTD_TYPE_XML;
+    }
+    if (ap_cstr_casecmpn(type, "text/", 5) == 0) {
+        return ZSTD_TYPE_TEXT;
+    }
+
+    return ZSTD_TYPE_OTHER;
+}
+
+static zstd_stats_t *stats_get(request_rec *r, zstd_server_config_t *conf) {
+
+    if (!stats_rows || conf->stats_index >= stats_nservers) {
+        return NULL;
+    }
+    return &stats_rows[conf->stats_index * ZSTD_TYPE_MAX
+                       + stats_type(r->content_type)];
+}
+
+static void stats_skip(request_rec *r, zstd_server_config_t *conf,
+                       zstd_skip_e reason) {
+
+    zstd_stats_t *stats = stats_get(r, conf);
+    if (stats) {
+        apr_atomic_inc64(&stats->skipped[reason]);
+    }
+}
+
+/* Account for a compressed response, once done */
+static void stats_done(zstd_ctx_t *ctx) {
+
+    static const apr_int64_t bounds[] = ZSTD_STATS_TIME_BOUNDS;
+    zstd_stats_t *stats = ctx->stats;
+    int i = 0;
+
+    if (!stats) {
+        return;
+    }
+    apr_atomic_add64(&stats->bytes_in, (apr_uint64_t)ctx->total_in);
+    apr_atomic_add64(&stats->bytes_out, (apr_uint64_t)ctx->total_out);
+    apr_atomic_add64(&stats->compress_usec, (apr_uint64_t)ctx->compress_usec);
+    apr_atomic_add64(&stats->cpu_usec, (apr_uint64_t)ctx->cpu_usec);
+    while (i < ZSTD_STATS_TIME_BUCKETS - 1
+           && ctx->compress_usec >= bounds[i] * 1000) {
+        i++;
+    }
+    apr_atomic_inc64(&stats->time_hist[i]);
+    ctx->stats = NULL;
+}
+
+static apr_status_t cleanup_stats(void *data) {
+    stats_shm = NULL;
+    stats_rows = NULL;
+    stats_nservers = 0;
+    return APR_SUCCESS;
+}
+
+/*
+ * Allocate the counters in shared memory before the children are forked,
+ * so that all of them update the same ones.
+ */
+static apr_status_t stats_init(apr_pool_t *p, server_rec *s) {
+
+    server_rec *sp;
+    apr_size_t size;
+    apr_status_t rv;
+    int n = 0;
+
+    for (sp = s; sp; sp = sp->next) {
+        n++;
+    }
+    size = sizeof(zstd_stats_t) * ZSTD_TYPE_MAX * n;
+
+    rv = apr_shm_create(&stats_shm, size, NULL, p);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        const char *fname = ap_runtime_dir_relative(p, "zstd_stats");
+        apr_shm_remove(fname, p);
+        rv = apr_shm_create(&stats_shm, size, fname, p);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(30323)
+                     "Failed to create shared memory, statistics disabled");
+        stats_shm = NULL;
+        return rv;
+    }
+
+    stats_rows = apr_shm_baseaddr_get(stats_shm);
+    memset(stats_rows, 0, size);
+    stats_servers = apr_palloc(p, sizeof(*stats_servers) * n);
+    stats_nservers = n;
+    for (n = 0, sp = s; sp; sp = sp->next, n++) {
+        zstd_server_config_t *sc;
+        sc = ap_get_module_config(sp->module_config, &zstd_module);
+        sc->stats_index = n;
+        stats_servers[n] = apr_psprintf(p, "%s:%d",
+                                        sp->server_hostname
+                                            ? sp->server_hostname : "",
+                                        (int)sp->port);
+    }
+    apr_pool_cleanup_register(p, stats_shm, cleanup_stats,
+                              apr_pool_cleanup_null);
+
+    return APR_SUCCESS;
+}
+
+/* Sum of the counters of a server (all content types when type < 0) */
+static void stats_sum(zstd_stats_t *sum, int server, int type) {
+
+    int t, i;
+
+    memset(sum, 0, sizeof(*sum));
+    for (t = 0; t < ZSTD_TYPE_MAX; t++) {
+        zstd_stats_t *row = &stats_rows[server * ZSTD_TYPE_MAX + t];
+
+        if (type >= 0 && t != type) {
+            continue;
+        }
+        sum->compressed += apr_atomic_read64(&row->compressed);
+        sum->precompressed += apr_atomic_read64(&row->precompressed);
+        for (i = 0; i < ZSTD_SKIP_MAX; i++) {
+            sum->skipped[i] += apr_atomic_read64(&row->skipped[i]);
+        }
+        sum->bytes_in += apr_atomic_read64(&row->bytes_in);
+        sum->bytes_out += apr_atomic_read64(&row->bytes_out);
+        sum->compress_usec += apr_atomic_read64(&row->compress_usec);
+        sum->cpu_usec += apr_atomic_read64(&row->cpu_usec);
+        sum->pool_hits += apr_atomic_read64(&row->pool_hits);
+        sum->pool_misses += apr_atomic_read64(&row->pool_misses);
+        for (i = 0; i < ZSTD_STATS_TIME_BUCKETS; i++) {
+            sum->time_hist[i] += apr_atomic_read64(&row->time_hist[i]);
+        }
+    }
+}
+
+/* mod_status: a summary per server */
+static int zstd_status_hook(request_rec *r, int flags) {
+
+    int n;
+
+    if (!stats_rows) {
+        return OK;
+    }
+
+    if (flags & AP_STATUS_SHORT) {
+        zstd_stats_t sum, all;
+
+        memset(&all, 0, sizeof(all));
+        for (n = 0; n < stats_nservers; n++) {
+            stats_sum(&sum, n, -1);
+            all.compressed += sum.compressed;
+            all.precompressed += sum.precompressed;
+            all.bytes_in += sum.bytes_in;
+            all.bytes_out += sum.bytes_out;
+            all.cpu_usec += sum.cpu_usec;
+        }
+        ap_rprintf(r, "ZstdCompressed: %" APR_UINT64_T_FMT "\n"
+                      "ZstdPrecompressed: %" APR_UINT64_T_FMT "\n"
+                      "ZstdBytesIn: %" APR_UINT64_T_FMT "\n"
+                      "ZstdBytesOut: %" APR_UINT64_T_FMT "\n"
+                      "ZstdCPUMicroseconds: %" APR_UINT64_T_FMT "\n",
+                   all.compressed, all.precompressed, all.bytes_in,
+                   all.bytes_out, all.cpu_usec);
+        return OK;
+    }
+
+    ap_rputs("<hr />\n<h1>mod_zstd</h1>\n<table border=\"0\">"
+             "<tr><th>Server</th><th>Compressed</th><th>Precompressed</th>"
+             "<th>Skipped</th><th>In</th><th>Out</th><th>Ratio</th>"
+             "<th>CPU ms</th><th>Pool hits</th></tr>\n", r);
+    for (n = 0; n < stats_nservers; n++) {
+        zstd_stats_t sum;
+        apr_uint64_t skipped = 0;
+        int i;
+
+        stats_sum(&sum, n, -1);
+        for (i = 0; i < ZSTD_SKIP_MAX; i++) {
+            skipped += sum.skipped[i];
+        }
+        ap_rprintf(r, "<tr><td>%s</td><td>%" APR_UINT64_T_FMT "</td>"
+                      "<td>%" APR_UINT64_T_FMT "</td>"
+                      "<td>%" APR_UINT64_T_FMT "</td>"
+                      "<td>%" APR_UINT64_T_FMT "</td>"
+                      "<td>%" APR_UINT64_T_FMT "</td><td>%d%%</td>"
+                      "<td>%" APR_UINT64_T_FMT "</td>"
+                      "<td>%" APR_UINT64_T_FMT "/%" APR_UINT64_T_FMT
+                      "</td></tr>\n",
+                   ap_escape_html(r->pool, stats_servers[n]),
+                   sum.compressed, sum.precompressed, skipped,
+                   sum.bytes_in, sum.bytes_out,
+                   sum.bytes_in ? (int)(sum.bytes_out * 100 / sum.bytes_in)
+                                : 0,
+                   sum.cpu_usec / 1000, sum.pool_hits,
+                   sum.pool_hits + sum.pool_misses);
+    }
+    ap_rputs("</table>\n", r);
+
+    return OK;
+}
+
+/*
+ * SetHandler zstd-status: every counter, per server and content type, in
+ * the Prometheus text format.
+ */
+static int zstd_status_handler(request_rec *r) {
+
+    static const apr_int64_t bounds[] = ZSTD_STATS_TIME_BOUNDS;
+    int n, t, i;
+
+    if (strcmp(r->handler, "zstd-status")) {
+        return DECLINED;
+    }
+    if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+
+    ap_set_content_type(r, "text/plain; version=0.0.4; charset=utf-8");
+    if (r->header_only || !stats_rows) {
+        return OK;
+    }
+
+    for (n = 0; n < stats_nservers; n++) {
+        for (t = 0; t < ZSTD_TYPE_MAX; t++) {
+            zstd_stats_t row;
+            apr_uint64_t cumulative = 0;
+            const char *labels;
+
+            stats_sum(&row, n, t);
+            labels = apr_psprintf(r->pool, "vhost=\"%s\",type=\"%s\"",
+                                  stats_servers[n], stats_type_names[t]);
+
+            ap_rprintf(r, "zstd_responses_total{%s,result=\"compressed\"} %"
+                          APR_UINT64_T_FMT "\n", labels, row.compressed);
+            ap_rprintf(r, "zstd_responses_total{%s,result=\"precompressed\"}"
+                          " %" APR_UINT64_T_FMT "\n", labels,
+                       row.precompressed);
+            for (i = 0; i < ZSTD_SKIP_MAX; i++) {
+                ap_rprintf(r, "zstd_responses_total{%s,result=\"skipped\","
+                              "reason=\"%s\"} %" APR_UINT64_T_FMT "\n",
+                           labels, stats_skip_names[i], row.skipped[i]);
+            }
+            ap_rprintf(r, "zstd_bytes_in_total{%s} %" APR_UINT64_T_FMT "\n"
+                          "zstd_bytes_out_total{%s} %" APR_UINT64_T_FMT "\n"
+                          "zstd_compress_seconds_total{%s} %.6f\n"
+                          "zstd_cpu_seconds_total{%s} %.6f\n"
+                          "zstd_context_pool_total{%s,result=\"hit\"} %"
+                          APR_UINT64_T_FMT "\n"
+                          "zstd_context_pool_total{%s,result=\"miss\"} %"
+                          APR_UINT64_T_FMT "\n",
+                       labels, row.bytes_in, labels, row.bytes_out,
+                       labels, row.compress_usec / 1e6,
+                       labels, row.cpu_usec / 1e6,
+                       labels, row.pool_hits, labels, row.pool_misses);
+            for (i = 0; i < ZSTD_STATS_TIME_BUCKETS; i++) {
+                cumulative += row.time_hist[i];
+                if (i < ZSTD_STATS_TIME_BUCKETS - 1) {
+                    ap_rprintf(r, "zstd_compress_time_bucket{%s,le=\"%.3f\"} %"
+                                  APR_UINT64_T_FMT "\n", labels,
+                               bounds[i] / 1000.0, cumulative);
+                } else {
+                    ap_rprintf(r, "zstd_compress_time_bucket{%s,le=\"+Inf\"}"
+                                  " %" APR_UINT64_T_FMT "\n", labels,
+                               cumulative);
+                }
+            }
+        }
+    }
+
+    return OK;
+}
+
+/*
+ * Share of the server's workers busy with requests, in permille, from the
+ * scoreboard. Scanning it is not free, so it is only sampled every so
+ * often; concurrent updates of the sample are harmless.
+ */
+static int server_busy_permille(void) {
+
+    apr_time_t now = apr_time_now();
+    int daemons = 0, threads = 0, total = 0, busy = 0, i, j;
+
+    if (now - busy_sampled < ZSTD_ADAPTIVE_SAMPLE_USEC
+        || !ap_exists_scoreboard_image()) {
+        return busy_permille;
+    }
+    busy_sampled = now;
+
+    ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &daemons);
+    ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &threads);
+    for (i = 0; i < daemons; i++) {
+        for (j = 0; j < threads; j++) {
+            worker_score *ws = ap_get_scoreboard_worker_from_indexes(i, j);
+
+            switch (ws->status) {
+            case SERVER_BUSY_READ:
+            case SERVER_BUSY_WRITE:
+            case SERVER_BUSY_LOG:
+            case SERVER_BUSY_DNS:
+                busy++;
+                /* fall through */
+            case SERVER_READY:
+            case SERVER_BUSY_KEEPALIVE:
+            case SERVER_CLOSING:
+                total++;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    busy_permille = total ? busy * 1000 / total : 0;
+    return busy_permille;
+}
+
+/*
+ * Compression level for a response in adaptive mode: the maximum when the
+ * server is idle, down to the minimum when it is saturated. The load is
+ * the highest of the share of busy workers on the server and of the
+ * threads of this child already compressing; large (or unknown size)
+ * responses, which cost the most, see it doubled.
+ */
+static int adaptive_level(const zstd_dir_config_t *dconf, apr_off_t size) {
+
+    int load = server_busy_permille();
+    int local = (int)apr_atomic_read32(&ctx_active) * 1000 / threads_per_child;
+
+    if (local > load) {
+        load = local;
+    }
+    if (size < 0 || size >= ZSTD_ADAPTIVE_LARGE_SIZE) {
+        load *= 2;
+    }
+    if (load > 1000) {
+        load = 1000;
+    }
+
+    return dconf->adaptive_max
+           - ((dconf->adaptive_max - dconf->adaptive_min) * load + 500) / 1000;
+}
+
+/*
+ * Reserve worker threads for one response out of the process-wide budget.
+ * It is all or nothing: a partial grant would configure contexts with
+ * unusual worker counts that the pool could hardly reuse.
+ */
+static int workers_acquire(int wanted) {
+
+    apr_uint32_t busy;
+
+    do {
+        busy = apr_atomic_read32(&workers_busy);
+        if (busy + (apr_uint32_t)wanted > workers_limit) {
+            return 0;
+        }
+    } while (apr_atomic_cas32(&workers_busy, busy + wanted, busy) != busy);
+
+    return wanted;
+}
+
+static void workers_release(int granted) {
+    if (granted > 0) {
+        apr_atomic_sub32(&workers_busy, (apr_uint32_t)granted);
+    }
+}
+
+static apr_status_t cleanup_ctx(void *data) {
+    zstd_ctx_t *ctx = data;
+    stats_done(ctx);
+    if (ctx->cctx) {
+        cctx_pool_put(ctx->cctx, &ctx->params, ctx->reserved);
+        if (!ctx->offloaded) {
+            workers_release(ctx->params.workers);
+        }
+        apr_atomic_dec32(&ctx_active);
+    }
+    ctx->cctx = NULL;
+    if (ctx->out.dst) {
+        apr_bucket_free(ctx->out.dst);
+        ctx->out.dst = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * ZstdMaxMemory: reserve what the context will take out of the budget of
+ * the child process. When short, idle contexts are freed first, then the
+ * response goes without worker threads, then at ZSTD_DEGRADED_LEVEL.
+ * Returns 0 when even that does not fit.
+ */
+static int reserve_ctx_memory(zstd_ctx_t *ctx, request_rec *r) {
+
+    zstd_cparams_t *params = &ctx->params;
+
+    for (;;) {
+        apr_size_t size = cctx_estimate(params);
+
+        if (memory_reserve(size)
+            || (cctx_pool_trim(size) && memory_reserve(size))) {
+            ctx->reserved = size;
+            return 1;
+        }
+
+        if (params->workers > 0) {
+            if (!ctx->offloaded) {
+                workers_release(params->workers);
+            }
+            ctx->offloaded = 0;
+            params->workers = 0;
+        } else if (params->compression_level > ZSTD_DEGRADED_LEVEL
+                   || params->ldm) {
+            params->compression_level = ZSTD_DEGRADED_LEVEL;
+            params->ldm = 0;
+            params->window_log = browser_window_log(ZSTD_DEGRADED_LEVEL,
+                                                    ctx->dconf->window_log,
+                                                    0);
+        } else {
+            ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                          "ZstdMaxMemory reached, not compressing");
+            return 0;
+        }
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                      "ZstdMaxMemory reached, trying level %d with %d "
+                      "workers", params->compression_level, params->workers);
+    }
+}
+
+/*
+ * Get a context, decided to compress, ready to: its dconf and dict are
+ * already set. The body is size_hint bytes if exact, otherwise at least
+ * that (what the first brigade has). Returns ZSTD_SKIP_MAX once started,
+ * otherwise why the response cannot be compressed: ZstdMaxMemory leaves
+ * no room for a context, or none could be created and configured.
+ */
+static zstd_skip_e start_ctx(zstd_ctx_t *ctx,
+                             zstd_server_config_t* conf,
+                             apr_off_t size_hint,
+                             int exact,
+                             apr_bucket_alloc_t *alloc,
+                             apr_pool_t *pool,
+                             request_rec* r) {
+
+    const zstd_dir_config_t *dconf = ctx->dconf;
+    const zstd_dict_t *dict = ctx->dict;
+    /* A HEAD has no body to hold to the pledge */
+    apr_off_t pledged = (exact && !r->header_only) ? size_hint : -1;
+
+    if (ctx->streaming) {
+        ctx->params.compression_level = dconf->stream_level;
+    } else if (dconf->adaptive_max) {
+        ctx->params.compression_level = adaptive_level(dconf, exact ? size_hint
+                                                                    : -1);
+    } else {
+        ctx->params.compression_level = dconf->compression_level;
+    }
+    ctx->params.window_log = browser_window_log(ctx->params.compression_level,
+                                                dconf->window_log, dconf->ldm);
+    ctx->params.ldm = dconf->ldm;
+    ctx->params.strategy = dconf->strategy;
+    ctx->params.checksum = dconf->checksum;
+    ctx->params.target_cblock_size = dconf->target_cblock_size;
+    if (ctx->streaming && !dconf->target_cblock_size) {
+        ctx->params.target_cblock_size = stream_cblock_size();
+    }
+    ctx->params.cdict = dict ? dict->cdict : NULL;
+    apr_atomic_inc32(&ctx_active);
+
+    /* Worker threads only pay off for large bodies, and are taken from the
+     * shared budget so that concurrency does not multiply them.
+     */
+    if (dconf->workers > 0 && size_hint >= dconf->workers_min_size
+        && !ctx->streaming) {
+        /* Offloaded jobs queue for the pool's threads instead, which
+         * bound compression CPU whatever the number of responses.
+         */
+#if ZSTD_HAS_THREAD_POOL
+        ctx->offloaded = (offload_pool != NULL);
+#endif
+        ctx->params.workers = ctx->offloaded ? dconf->workers
+                                             : workers_acquire(dconf->workers);
+    }
+
+    if (memory_limit && !reserve_ctx_memory(ctx, r)) {
+        apr_atomic_dec32(&ctx_active);
+        return ZSTD_SKIP_MEMORY;
+    }
+
+    ctx->cctx = cctx_pool_get(&ctx->params, r);
+    ctx->pool_hit = (ctx->cctx != NULL);
+    if (!ctx->cctx) {
+        ctx->cctx = ZSTD_createCCtx();
+        if (!ctx->cctx) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30351)
+                          "[CREATE_CTX] ZSTD_createCCtx failed");
+        } else if (!apply_cparams(ctx->cctx, &ctx->params, r)) {
+            ZSTD_freeCCtx(ctx->cctx);
+            ctx->cctx = NULL;
+        }
+    }
+    if (!ctx->cctx) {
+        if (!ctx->offloaded) {
+            workers_release(ctx->params.workers);
+        }
+        memory_release(ctx->reserved);
+        ctx->reserved = 0;
+        apr_atomic_dec32(&ctx_active);
+        return ZSTD_SKIP_ERROR;
+    }
+    ctx->stats = stats_get(r, conf);
+
+    /* A known size lets zstd size its tables down to small bodies, and is
+     * written in the frame header for the decoder to allocate once.
+     */
+    if (pledged >= 0) {
+        size_t rvsp = ZSTD_CCtx_setPledgedSrcSize(ctx->cctx,
+                                                  (unsigned long long)pledged);
+        if (ZSTD_isError(rvsp)) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(30327)
+                          "[CREATE_CTX] ZSTD_CCtx_setPledgedSrcSize(%"
+                          APR_OFF_T_FMT "): %s", pledged,
+                          ZSTD_getErrorName(rvsp));
+        }
+    }
+    if (ctx->stats) {
+        apr_atomic_inc64(&ctx->stats->compressed);
+        apr_atomic_inc64(ctx->pool_hit ? &ctx->stats->pool_hits
+                                       : &ctx->stats->pool_misses);
+    }
+
+    apr_pool_cleanup_register(pool, ctx, cleanup_ctx, apr_pool_cleanup_null);
+    ZSTD_PROBE3(compress__start, r->uri, ctx->params.compression_level,
+                ctx->params.workers);
+
+    ctx->bb = apr_brigade_create(pool, alloc);
+    ctx->out_size = dconf->out_buffer_size ? (apr_size_t)dconf->out_buffer_size
+                                           : ZSTD_CStreamOutSize();
+    ctx->total_in = 0;
+    ctx->total_out = 0;
+    ctx->last_seen = ctx->last_flush = apr_time_now();
+
+    /* A "dcz" stream starts with the hash of the dictionary it needs */
+    if (dict) {
+        char *header = apr_palloc(pool, ZSTD_DCZ_MAGIC_LEN + ZSTD_SHA256_LEN);
+        memcpy(header, ZSTD_DCZ_MAGIC, ZSTD_DCZ_MAGIC_LEN);
+        memcpy(header + ZSTD_DCZ_MAGIC_LEN, dict->sha256, ZSTD_SHA256_LEN);
+        APR_BRIGADE_INSERT_TAIL(ctx->bb, apr_bucket_pool_create(header,
+                                ZSTD_DCZ_MAGIC_LEN + ZSTD_SHA256_LEN, pool,
+                                alloc));
+        ctx->total_out += ZSTD_DCZ_MAGIC_LEN + ZSTD_SHA256_LEN;
+        ctx->pending_out += ZSTD_DCZ_MAGIC_LEN + ZSTD_SHA256_LEN;
+    }
+
+    return ZSTD_SKIP_MAX;
+}
+
+/*
+ * Hand the staging buffer over to a heap bucket, without copying. It goes
+ * back to the connection's bucket allocator, to be reused by the next one,
+ * as soon as the bucket is destroyed downstream.
+ */
+static void emit_output(zstd_ctx_t *ctx) {
+
+    apr_bucket *b = apr_bucket_heap_create(ctx->out.dst, ctx->out.pos,
+                                           apr_bucket_free,
+                                           ctx->bb->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(ctx->bb, b);
+    ctx->total_out += ctx->out.pos;
+    ctx->pending_out += ctx->out.pos;
+
+    /* ZstdCacheDynamic: the output is also written aside */
+    if (ctx->cache_file && ctx->cache_path
+        && apr_file_write_full(ctx->cache_file, ctx->out.dst, ctx->out.pos,
+                               NULL) != APR_SUCCESS) {
+        ctx->cache_path = NULL;
+    }
+    if (ctx->pending_out > ctx->max_pending_out) {
+        ctx->max_pending_out = ctx->pending_out;
+    }
+    ctx->out.dst = NULL;
+}
+
+static apr_status_t process_bucket(zstd_ctx_t *ctx,
+                                  ZSTD_EndDirective mode,
+                                  const void *data,
+                                  apr_size_t len,
+                                  ap_filter_t *f) {
+
+    size_t remaining;
+    apr_time_t start = apr_time_now();
+    apr_off_t out_start = ctx->total_out;
+    apr_interval_time_t elapsed;
+
+    ZSTD_inBuffer input = { data, len, 0 };
+
+    ZSTD_PROBE3(bucket__entry, f->r->uri, (int)mode, len);
+
+    do {
+        if (!ctx->out.dst) {
+            ctx->out.dst = apr_bucket_alloc(ctx->out_size,
+                                            ctx->bb->bucket_alloc);
+            ctx->out.size = ctx->out_size;
+            ctx->out.pos = 0;
+        }
+        /*
+         * https://facebook.github.io/zstd/zstd_manual.html#Chapter8
+         * ex. https://fossies.org/linux/cyrus-imapd/imap/httpd.c
+         */
+        remaining = ZSTD_compressStream2(ctx->cctx, &ctx->out, &input, mode);
+        ctx->calls++;
+        if (ZSTD_isError(remaining)) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, f->r, APLOGNO(30305)
+                "Error while processing bucket: %s",
+                ZSTD_getErrorName(remaining));
+            return APR_EGENERAL;
+        }
+        if (ctx->out.pos == ctx->out.size) {
+            emit_output(ctx);
+        }
+    } while ((mode != ZSTD_e_continue && remaining)
+             || (input.pos != input.size));
+
+    /* Partially filled buffers are only emitted when flushing, otherwise
+     * they keep being filled by the next buckets.
+     */
+    if (mode != ZSTD_e_continue && ctx->out.dst && ctx->out.pos > 0) {
+        emit_output(ctx);
+    }
+
+    if (mode == ZSTD_e_flush) {
+        ctx->flushes++;
+    }
+    elapsed = apr_time_now() - start;
+    ctx->compress_usec += elapsed;
+    ctx->total_in += len;
+    ctx->unflushed_in += len;
+
+    ZSTD_PROBE4(bucket__return, f->r->uri, (int)mode,
+                ctx->total_out - out_start, elapsed);
+    return APR_SUCCESS;
+}
+
+/*
+ * Pass what has been compressed so far downstream. With do_flush, zstd is
+ * asked to emit everything buffered so far first, so the client can decode
+ * all input received until now.
+ */
+static apr_status_t pass_output(zstd_ctx_t *ctx, ap_filter_t *f,
+                                int do_flush) {
+
+    apr_status_t rv;
+    int sampling = (ctx->cpu_mark != 0);
+
+    if (do_flush) {
+        if (ctx->unflushed_in) {
+            rv = process_bucket(ctx, ZSTD_e_flush, NULL, 0, f);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+        }
+        ctx->unflushed_in = 0;
+        ctx->last_flush = apr_time_now();
+    }
+
+    if (APR_BRIGADE_EMPTY(ctx->bb)) {
+        return APR_SUCCESS;
+    }
+
+    cpu_sample_stop(ctx);
+    rv = ap_pass_brigade(f->next, ctx->bb);
+    apr_brigade_cleanup(ctx->bb);
+    ctx->pending_out = 0;
+    if (sampling) {
+        cpu_sample_start(ctx);
+    }
+    return rv;
+}
+
+/*
+ * Have the client get all that was compressed so far now, as the next
+ * input may take a while.
+ */
+static apr_status_t flush_to_client(zstd_ctx_t *ctx, ap_filter_t *f) {
+
+    apr_status_t rv = pass_output(ctx, f, 1);
+
+    if (rv == APR_SUCCESS) {
+        APR_BRIGADE_INSERT_TAIL(ctx->bb,
+                                apr_bucket_flush_create(ctx->bb->bucket_alloc));
+        rv = pass_output(ctx, f, 0);
+    }
+    return rv;
+}
+
+/*
+ * File buckets are read as mmap slices of up to APR_MMAP_LIMIT, without
+ * copy, when EnableMMAP allows it. Otherwise they are read in chunks of
+ * ZSTD_CStreamInSize(), zstd's block size, rather than of 8 KB.
+ */
+static void prepare_file_bucket(apr_bucket *e) {
+
+#if ZSTD_HAS_FILE_BUF_SIZE
+#if APR_HAS_MMAP
+    if (((apr_bucket_file *)e->data)->can_mmap) {
+        return;
+    }
+#endif
+    apr_bucket_file_set_buf_size(e, ZSTD_CStreamInSize());
+#endif
+}
+
+static const char *get_content_encoding(request_rec *r) {
+
+    const char *encoding;
+
+    encoding = apr_table_get(r->headers_out, "Content-Encoding");
+    if (encoding) {
+        const char *err_enc;
+        err_enc = apr_table_get(r->err_headers_out, "Content-Encoding");
+        if (err_enc) {
+            encoding = apr_pstrcat(r->pool, encoding, ",", err_enc, NULL);
+        }
+    } else {
+        encoding = apr_table_get(r->err_headers_out, "Content-Encoding");
+    }
+
+    if (r->content_encoding) {
+        encoding = encoding ? apr_pstrcat(r->pool, encoding, ",",
+                                          r->content_encoding, NULL)
+                            : r->content_encoding;
+    }
+
+    return encoding;
+}
+
+/*
+ * A qvalue (RFC 9110, 12.4.2) in thousandths, ZSTD_UNSET if malformed.
+ * *end is set past it.
+ */
+static int parse_qvalue(const char *s, const char **end) {
+
+    int q, scale;
+
+    if (*s != '0' && *s != '1') {
+        *end = s;
+        return ZSTD_UNSET;
+    }
+    q = (*s++ - '0') * 1000;
+    if (*s == '.') {
+        for (++s, scale = 100; scale && apr_isdigit(*s); scale /= 10) {
+            q += (*s++ - '0') * scale;
+        }
+    }
+    *end = s;
+
+    return q > 1000 ? 1000 : q;
+}
+
+/*
+ * Parse Accept-Encoding (RFC 9110, 12.5.3) in one pass, without copying:
+ * it is scanned once per request, whatever the number of filters asking.
+ */
+static void parse_accept_encoding(const char *s, zstd_accept_t *acc) {
+
+    int i;
+
+    for (i = 0; i < ZSTD_CODING_MAX; i++) {
+        acc->q[i] = ZSTD_UNSET;
+    }
+    acc->q_any = ZSTD_UNSET;
+
+    while (s && *s) {
+        const char *name;
+        apr_size_t len;
+        int q = 1000;
+        int *slot = NULL;
+
+        while (*s == ',' || apr_isspace(*s)) {
+            ++s;
+        }
+        name = s;
+        while (*s && *s != ',' && *s != ';' && !apr_isspace(*s)) {
+            ++s;
+        }
+        len = s - name;
+
+        /* Parameters, of which only q matters */
+        for (;;) {
+            while (apr_isspace(*s)) {
+                ++s;
+            }
+            if (*s != ';') {
+                break;
+            }
+            ++s;
+            while (apr_isspace(*s)) {
+                ++s;
+            }
+            if ((*s == 'q' || *s == 'Q') && s[1] == '=') {
+                int v = parse_qvalue(s + 2, &s);
+
+                if (v != ZSTD_UNSET) {
+                    q = v;
+                }
+            }
+            while (*s && *s != ';' && *s != ',') {
+                ++s;
+            }
+        }
+        while (*s && *s != ',') {
+            ++s;
+        }
+
+        if (len == 1 && *name == '*') {
+            slot = &acc->q_any;
+        } else if (len == 6 && ap_cstr_casecmpn(name, "x-gzip", 6) == 0) {
+            slot = &acc->q[ZSTD_CODING_GZIP];
+        } else {
+            for (i = 0; i < ZSTD_CODING_MAX; i++) {
+                if (len == strlen(coding_names[i])
+                    && ap_cstr_casecmpn(name, coding_names[i], len) == 0) {
+                    slot = &acc->q[i];
+                    break;
+                }
+            }
+        }
+        if (slot && q > *slot) {
+            *slot = q;
+        }
+    }
+}
+
+/* The parsed Accept-Encoding of the request, shared by the filters */
+static const zstd_accept_t *get_accept(request_rec *r) {
+
+    zstd_accept_t *acc = ap_get_module_config(r->request_config,
+                                              &zstd_module);
+
+    if (!acc) {
+        acc = apr_palloc(r->pool, sizeof(*acc));
+        parse_accept_encoding(apr_table_get(r->headers_in,
+                                            "Accept-Encoding"), acc);
+        ap_set_module_config(r->request_config, &zstd_module, acc);
+    }
+
+    return acc;
+}
+
+/* Whether the client accepts a coding, and with which q-value */
+static int accept_q(const zstd_accept_t *acc, zstd_coding_e coding) {
+
+    if (acc->q[coding] != ZSTD_UNSET) {
+        return acc->q[coding];
+    }
+    return acc->q_any != ZSTD_UNSET ? acc->q_any : 0;
+}
+
+/*
+ * The coding an encoder filter is for, ZSTD_CODING_MAX if none.
+ * AddOutputFilterByType adds it through a mod_filter harness, named after
+ * it as "BYTYPE:<filter>", which counts too.
+ */
+static zstd_coding_e encoder_coding(const ap_filter_t *f) {
+
+    const char *name = f->frec->name;
+
+    if (ap_cstr_casecmpn(name, "bytype:", 7) == 0) {
+        name += 7;
+    }
+    if (ap_cstr_casecmp(name, "zstd_compress") == 0) {
+        return ZSTD_CODING_ZSTD;
+    }
+    if (ap_cstr_casecmp(name, "brotli_compress") == 0) {
+        return ZSTD_CODING_BR;
+    }
+    if (ap_cstr_casecmp(name, "deflate") == 0) {
+        return ZSTD_CODING_GZIP;
+    }
+    return ZSTD_CODING_MAX;
+}
+
+/*
+ * ZstdPreference: the codings the client accepts, by the q-value it gives
+ * them, ties going to the first listed. Returns how many are in order.
+ */
+static int rank_codings(const zstd_accept_t *acc,
+                        const zstd_dir_config_t *dconf,
+                        zstd_coding_e *order) {
+
+    int q[ZSTD_CODING_MAX];
+    int i, j, n = 0;
+
+    for (i = 0; i < ZSTD_CODING_MAX && dconf->preference[i] != ZSTD_UNSET;
+         i++) {
+        zstd_coding_e coding = dconf->preference[i];
+        int v = accept_q(acc, coding);
+
+        if (!v) {
+            continue;
+        }
+        for (j = n; j > 0 && q[j - 1] < v; j--) {
+            order[j] = order[j - 1];
+            q[j] = q[j - 1];
+        }
+        order[j] = coding;
+        q[j] = v;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Puts the encoders ZstdPreference ranks in its order on the response, the
+ * pick first, and notes the pick as ZSTD_NOTE_CODING. Whether they encode
+ * depends on the response, which is not known yet: each one that does
+ * sets Content-Encoding, which the next ones leave alone, and one that
+ * declines leaves the response to the next. Moved filters go last among
+ * those of their type, which they must share.
+ */
+static void order_encoders(request_rec *r, const zstd_dir_config_t *dconf) {
+
+    ap_filter_t *encoders[ZSTD_CODING_MAX] = { NULL };
+    zstd_coding_e order[ZSTD_CODING_MAX];
+    int rank[ZSTD_CODING_MAX];
+    ap_filter_t *f;
+    int i, n, last = -1, sorted = 1;
+
+    n = rank_codings(get_accept(r), dconf, order);
+    for (i = 0; i < ZSTD_CODING_MAX; i++) {
+        rank[i] = -1;
+    }
+    for (i = 0; i < n; i++) {
+        rank[order[i]] = i;
+    }
+    for (f = r->output_filters; f && f->frec->ftype < AP_FTYPE_PROTOCOL;
+         f = f->next) {
+        zstd_coding_e coding = encoder_coding(f);
+
+        if (coding == ZSTD_CODING_MAX || rank[coding] < 0
+            || encoders[coding]) {
+            continue;
+        }
+        encoders[coding] = f;
+        if (rank[coding] < last) {
+            sorted = 0;
+        }
+        last = rank[coding];
+    }
+    if (!encoders[ZSTD_CODING_ZSTD]) {
+        return;
+    }
+    apr_table_setn(r->notes, ZSTD_NOTE_CODING, coding_names[order[0]]);
+    if (sorted) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (encoders[order[i]]) {
+            ap_remove_output_filter(encoders[order[i]]);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        f = encoders[order[i]];
+        if (f) {
+            ap_add_output_filter_handle(f->frec, f->ctx, r, r->connection);
+        }
+    }
+}
+
+/*
+ * Once compressing, the other encoders ZstdPreference ranks are told to
+ * stand down through their no-brotli or no-gzip variables, for those which
+ * would not see Content-Encoding.
+ */
+static void stand_down_encoders(request_rec *r,
+                                const zstd_dir_config_t *dconf) {
+
+    int i;
+
+    for (i = 0; i < ZSTD_CODING_MAX && dconf->preference[i] != ZSTD_UNSET;
+         i++) {
+        if (dconf->preference[i] == ZSTD_CODING_BR) {
+            apr_table_setn(r->subprocess_env, "no-brotli", "1");
+        } else if (dconf->preference[i] == ZSTD_CODING_GZIP) {
+            apr_table_setn(r->subprocess_env, "no-gzip", "1");
+        }
+    }
+}
+
+/*
+ * Size of the response body: the Content-Length if known, or else what the
+ * first brigade holds (all of it if it ends with EOS). *exact tells whether
+ * that is the whole body.
+ */
+static apr_off_t get_body_size(request_rec *r, apr_bucket_brigade *bb,
+                               int *exact) {
+
+    const char *clen = apr_table_get(r->headers_out, "Content-Length");
+    apr_off_t size = 0;
+    apr_bucket *e;
+    char *end;
+
+    if (clen && apr_strtoff(&size, clen, &end, 10) == APR_SUCCESS
+        && !*end && size >= 0) {
+        *exact = 1;
+        return size;
+    }
+
+    size = 0;
+    *exact = 0;
+    for (e = APR_BRIGADE_FIRST(bb);
+         e != APR_BRIGADE_SENTINEL(bb);
+         e = APR_BUCKET_NEXT(e)) {
+        if (APR_BUCKET_IS_EOS(e)) {
+            *exact = 1;
+            break;
+        }
+        if (e->length == (apr_size_t)-1) {
+            break;
+        }
+        size += e->length;
+    }
+
+    return size;
+}
+
+/*
+ * Whether the response is a stream (ZstdStreamTypes): content produced over
+ * time, each part to reach the client as soon as it is, in a frame that
+ * lasts for the whole response so that later parts compress against the
+ * earlier ones.
+ */
+static int is_stream_response(request_rec *r,
+                              const zstd_dir_config_t *dconf) {
+
+    int i;
+
+    if (!r->content_type) {
+        return 0;
+    }
+    if (!dconf->stream_types) {
+        return is_type(r->content_type, ZSTD_DEFAULT_STREAM_TYPE);
+    }
+    for (i = 0; i < dconf->stream_types->nelts; i++) {
+        if (is_type(r->content_type,
+                    APR_ARRAY_IDX(dconf->stream_types, i, const char *))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Whether the size of the body is within ZstdMinLength and ZstdMaxLength.
+ * Returns OK if so, DECLINED with the reason if not, or APR_INCOMPLETE if
+ * the body is of unknown length and must be held until more of it tells.
+ * A flush means the handler wants out what it has, whose size is what can
+ * be judged then. ZstdMaxLength only holds for a body whose length is
+ * known up front: one that grows past it after compression started is
+ * compressed whole.
+ */
+static int check_body_size(request_rec *r, apr_bucket_brigade *bb,
+                           const zstd_dir_config_t *dconf,
+                           zstd_skip_e *reason) {
+
+    const char *clen = apr_table_get(r->headers_out, "Content-Length");
+    apr_off_t size = 0;
+    int complete = 0;
+    apr_bucket *e;
+    char *end;
+
+    if (clen && apr_strtoff(&size, clen, &end, 10) == APR_SUCCESS
+        && !*end && size >= 0) {
+        complete = 1;
+    } else {
+        size = 0;
+        for (e = APR_BRIGADE_FIRST(bb);
+             e != APR_BRIGADE_SENTINEL(bb);
+             e = APR_BUCKET_NEXT(e)) {
+            if (APR_BUCKET_IS_EOS(e)) {
+                complete = 1;
+                break;
+            }
+            if (APR_BUCKET_IS_FLUSH(e)) {
+                break;
+            }
+            if (e->length == (apr_size_t)-1) {
+                const char *data;
+                apr_size_t len;
+
+                /* morph it into data of known length, if it is there:
+                 * a slow backend is not waited for to decide
+                 */
+                if (apr_bucket_read(e, &data, &len, APR_NONBLOCK_READ)
+                        != APR_SUCCESS) {
+                    break;
+                }
+            }
+            size += e->length;
+            if (size >= dconf->min_length && !dconf->max_length) {
+                return OK;
+            }
+        }
+        if (!complete && e == APR_BRIGADE_SENTINEL(bb)
+            && size < dconf->min_length) {
+            return APR_INCOMPLETE;
+        }
+    }
+
+    if (complete && size < dconf->min_length) {
+        *reason = ZSTD_SKIP_TOO_SMALL;
+        return DECLINED;
+    }
+    if (dconf->max_length && size > dconf->max_length) {
+        *reason = ZSTD_SKIP_TOO_LARGE;
+        return DECLINED;
+    }
+
+    return OK;
+}
+
+/*
+ * Whether the body looks already compressed (or random), judging by the
+ * Shannon entropy of its first ZSTD_PROBE_SIZE bytes. Less than
+ * ZSTD_PROBE_MIN_SIZE bytes at hand are given the benefit of the doubt.
+ */
+static int looks_incompressible(apr_bucket_brigade *bb) {
+
+    apr_size_t counts[256] = { 0 };
+    apr_size_t n = 0, i;
+    double entropy = 0;
+    apr_bucket *e;
+
+    for (e = APR_BRIGADE_FIRST(bb);
+         e != APR_BRIGADE_SENTINEL(bb) && n < ZSTD_PROBE_SIZE;
+         e = APR_BUCKET_NEXT(e)) {
+        const unsigned char *data;
+        apr_size_t len;
+
+        if (APR_BUCKET_IS_METADATA(e)) {
+            if (APR_BUCKET_IS_EOS(e) || APR_BUCKET_IS_FLUSH(e)) {
+                break;
+            }
+            continue;
+        }
+        if (apr_bucket_read(e, (const char **)&data, &len,
+                            APR_NONBLOCK_READ) != APR_SUCCESS) {
+            break;
+        }
+        if (len > ZSTD_PROBE_SIZE - n) {
+            len = ZSTD_PROBE_SIZE - n;
+        }
+        for (i = 0; i < len; i++) {
+            counts[data[i]]++;
+        }
+        n += len;
+    }
+
+    if (n < ZSTD_PROBE_MIN_SIZE) {
+        return 0;
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (counts[i]) {
+            double p = (double)counts[i] / n;
+            entropy -= p * log2(p);
+        }
+    }
+
+    return entropy > ZSTD_PROBE_MAX_ENTROPY;
+}
+
+/*
+ * Whether the brigade is the whole content of the requested file, as sent
+ * by the default handler, so that another representation of it can be
+ * sent instead.
+ */
+static int is_static_file(request_rec *r, apr_bucket_brigade *bb) {
+
+    apr_bucket *e;
+    apr_off_t len = 0;
+
+    if (r->finfo.filetype != APR_REG || !r->filename) {
+        return 0;
+    }
+
+    for (e = APR_BRIGADE_FIRST(bb);
+         e != APR_BRIGADE_SENTINEL(bb);
+         e = APR_BUCKET_NEXT(e)) {
+        if (APR_BUCKET_IS_EOS(e)) {
+            return len == r->finfo.size;
+        }
+        if (!APR_BUCKET_IS_FILE(e)) {
+            return 0;
+        }
+        len += e->length;
+    }
+
+    return 0;
+}
+
+/*
+ * Replace the brigade with the content of an already compressed file, sent
+ * as is (sendfile/mmap) with its own Content-Length, in place of a body of
+ * size_in bytes (-1 if unknown). With rest, bb is only the beginning of
+ * the body: the filter stays to discard what follows.
+ */
+static apr_status_t send_compressed_file(ap_filter_t *f,
+                                         apr_bucket_brigade *bb,
+                                         zstd_server_config_t *conf,
+                                         const char *path,
+                                         apr_finfo_t *finfo,
+                                         apr_off_t size_in,
+                                         zstd_ctx_t *rest) {
+
+    request_rec *r = f->r;
+    zstd_stats_t *stats = stats_get(r, conf);
+    core_dir_config *d = ap_get_core_module_config(r->per_dir_config);
+    apr_int32_t flags = APR_FOPEN_READ | APR_FOPEN_BINARY;
+    apr_file_t *fd;
+    apr_bucket *e;
+    apr_status_t rv;
+
+#if APR_HAS_SENDFILE
+    if (d->enable_sendfile == ENABLE_SENDFILE_ON) {
+        flags |= APR_FOPEN_SENDFILE_ENABLED;
+    }
+#endif
+
+    rv = apr_file_open(&fd, path, flags, APR_FPROT_OS_DEFAULT, r->pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    apr_brigade_cleanup(bb);
+    e = apr_brigade_insert_file(bb, fd, 0, finfo->size, r->pool);
+#if APR_HAS_MMAP
+    if (d->enable_mmap == ENABLE_MMAP_OFF) {
+        apr_bucket_file_enable_mmap(e, 0);
+    }
+#endif
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(f->c->bucket_alloc));
+
+    ap_set_content_length(r, finfo->size);
+    if (rest) {
+        rest->cached = 1;
+    } else {
+        ap_remove_output_filter(f);
+    }
+
+    if (stats) {
+        apr_atomic_inc64(&stats->precompressed);
+        if (size_in >= 0) {
+            apr_atomic_add64(&stats->bytes_in, (apr_uint64_t)size_in);
+        }
+        apr_atomic_add64(&stats->bytes_out, (apr_uint64_t)finfo->size);
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                  "sending precompressed %s", path);
+    return ap_pass_brigade(f->next, bb);
+}
+
+#if APR_HAS_THREADS
+/* FNV-1a, which is plenty to name cache entries */
+static apr_uint64_t hash_update(apr_uint64_t h, const void *data,
+                                apr_size_t len) {
+
+    const unsigned char *p = data;
+
+    while (len--) {
+        h ^= *p++;
+        h *= APR_UINT64_C(0x100000001b3);
+    }
+    return h;
+}
+
+static apr_uint64_t cache_key(request_rec *r, int level,
+                              apr_off_t frame_size) {
+
+    apr_uint64_t h = APR_UINT64_C(0xcbf29ce484222325);
+
+    h = hash_update(h, r->filename, strlen(r->filename));
+    h = hash_update(h, &r->finfo.mtime, sizeof(r->finfo.mtime));
+    h = hash_update(h, &r->finfo.size, sizeof(r->finfo.size));
+    h = hash_update(h, &level, sizeof(level));
+    if (frame_size > 0) {
+        h = hash_update(h, &frame_size, sizeof(frame_size));
+    }
+    return h ? h : 1;
+}
+
+/* Entries are spread over 256 directories by the first byte of their name */
+static const char *cache_entry_path(apr_pool_t *p, zstd_server_config_t *conf,
+                                    const char *name) {
+    return apr_pstrcat(p, conf->cache_root, "/", apr_pstrndup(p, name, 2),
+                       "/", name + 2, ".zst", NULL);
+}
+
+static const char *cache_path(apr_pool_t *p, zstd_server_config_t *conf,
+                              apr_uint64_t key) {
+
+    char name[24];
+
+    apr_snprintf(name, sizeof(name), "%016" APR_UINT64_T_HEX_FMT, key);
+    return cache_entry_path(p, conf, name);
+}
+
+/*
+ * Entry of a dynamic response, named after the SHA-256 of its URL, its
+ * entity tag and the settings it is compressed with (not the level picked
+ * by ZstdAdaptiveLevel, any will do). The client picks the query string:
+ * with a hash it could collide, it could be sent the entry of another URL.
+ * The key is the beginning of the digest, to tell inflight entries apart.
+ */
+static const char *cache_response_path(request_rec *r,
+                                       zstd_server_config_t *conf,
+                                       const zstd_dir_config_t *dconf,
+                                       const char *etag, apr_uint64_t *key) {
+
+    unsigned char digest[ZSTD_SHA256_LEN];
+    char name[ZSTD_SHA256_LEN * 2 + 1];
+    const char *id;
+    int i;
+
+    /* Lengths first, for no two different keys to be the same string */
+    id = apr_psprintf(r->pool, "%s %" APR_SIZE_T_FMT ":%s %d:%s %"
+                      APR_SIZE_T_FMT ":%s %d %d %d %d %d %d %d %d",
+                      r->server->server_hostname,
+                      strlen(r->uri), r->uri,
+                      r->args ? (int)strlen(r->args) : -1,
+                      r->args ? r->args : "",
+                      strlen(etag), etag,
+                      dconf->compression_level, dconf->adaptive_min,
+                      dconf->adaptive_max, dconf->window_log, dconf->ldm,
+                      dconf->strategy, dconf->checksum,
+                      dconf->target_cblock_size);
+    sha256((const unsigned char *)id, strlen(id), digest);
+    ap_bin2hex(digest, ZSTD_SHA256_LEN, name);
+
+    for (*key = 0, i = 0; i < 8; i++) {
+        *key = (*key << 8) | digest[i];
+    }
+    if (!*key) {
+        *key = 1;
+    }
+    return cache_entry_path(r->pool, conf, name);
+}
+
+/* Mark a key as being compressed; false if it already is, or too busy */
+static int cache_inflight_add(apr_uint64_t key) {
+
+    int i, slot = -1;
+
+    apr_thread_mutex_lock(cache_mutex);
+    for (i = 0; i < ZSTD_CACHE_INFLIGHT_MAX; i++) {
+        if (cache_inflight[i] == key) {
+            slot = -1;
+            break;
+        }
+        if (slot < 0 && !cache_inflight[i]) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        cache_inflight[slot] = key;
+    }
+    apr_thread_mutex_unlock(cache_mutex);
+
+    return slot >= 0;
+}
+
+static void cache_inflight_remove(apr_uint64_t key) {
+
+    int i;
+
+    apr_thread_mutex_lock(cache_mutex);
+    for (i = 0; i < ZSTD_CACHE_INFLIGHT_MAX; i++) {
+        if (cache_inflight[i] == key) {
+            cache_inflight[i] = 0;
+            break;
+        }
+    }
+    if (cache_cond) {
+        apr_thread_cond_broadcast(cache_cond);
+    }
+    apr_thread_mutex_unlock(cache_mutex);
+}
+
+/*
+ * Wait until no request of this process is compressing a key anymore, for
+ * at most timeout. Returns whether none is.
+ */
+static int cache_inflight_wait(apr_uint64_t key,
+                               apr_interval_time_t timeout) {
+
+    apr_time_t deadline = apr_time_now() + timeout;
+    int i, busy;
+
+    apr_thread_mutex_lock(cache_mutex);
+    for (;;) {
+        apr_time_t now;
+
+        for (busy = 0, i = 0; i < ZSTD_CACHE_INFLIGHT_MAX && !busy; i++) {
+            busy = (cache_inflight[i] == key);
+        }
+        now = apr_time_now();
+        if (!busy || now >= deadline) {
+            break;
+        }
+        apr_thread_cond_timedwait(cache_cond, cache_mutex, deadline - now);
+    }
+    apr_thread_mutex_unlock(cache_mutex);
+
+    return !busy;
+}
+
+/* Least recently used first */
+static int cache_entry_cmp(const void *a, const void *b) {
+
+    const zstd_cache_entry_t *ea = a, *eb = b;
+
+    return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/*
+ * ZstdCacheMaxSize: list the entries of the cache and, when they are over
+ * the limit, remove the least recently used ones (see cache_touch()) down
+ * to a share below it. Files still being written are left alone.
+ */
+static void *APR_THREAD_FUNC cache_sweep(apr_thread_t *thd, void *data) {
+
+    zstd_cache_sweep_t *sweep = data;
+    apr_pool_t *p = sweep->pool;
+    apr_int32_t wanted = APR_FINFO_NAME | APR_FINFO_TYPE | APR_FINFO_SIZE
+                         | APR_FINFO_MTIME;
+    apr_array_header_t *entries;
+    apr_off_t total = 0;
+    apr_dir_t *root, *dir;
+    apr_finfo_t sub, finfo;
+    apr_status_t rv;
+    int i, removed = 0;
+
+    entries = apr_array_make(p, 1024, sizeof(zstd_cache_entry_t));
+    if (apr_dir_open(&root, sweep->root, p) == APR_SUCCESS) {
+        while (apr_dir_read(&sub, APR_FINFO_NAME | APR_FINFO_TYPE, root)
+                   == APR_SUCCESS) {
+            const char *path;
+
+            if (sub.filetype != APR_DIR || strlen(sub.name) != 2
+                || sub.name[0] == '.') {
+                continue;
+            }
+            path = apr_pstrcat(p, sweep->root, "/", sub.name, NULL);
+            if (apr_dir_open(&dir, path, p) != APR_SUCCESS) {
+                continue;
+            }
+            while ((rv = apr_dir_read(&finfo, wanted, dir)) == APR_SUCCESS
+                   || rv == APR_INCOMPLETE) {
+                apr_size_t len = strlen(finfo.name);
+                zstd_cache_entry_t *e;
+
+                /* Temporary files end with ".zst.XXXXXX" */
+                if ((finfo.valid & wanted) != wanted
+                    || finfo.filetype != APR_REG || len < 4
+                    || strcmp(finfo.name + len - 4, ".zst") != 0) {
+                    continue;
+                }
+                e = apr_array_push(entries);
+                e->path = apr_pstrcat(p, path, "/", finfo.name, NULL);
+                e->size = finfo.size;
+                e->mtime = finfo.mtime;
+                total += finfo.size;
+            }
+            apr_dir_close(dir);
+        }
+        apr_dir_close(root);
+    }
+
+    if (total > sweep->max_size) {
+        apr_off_t target = sweep->max_size
+                           - sweep->max_size / ZSTD_CACHE_SWEEP_SHARE;
+
+        qsort(entries->elts, entries->nelts, sizeof(zstd_cache_entry_t),
+              cache_entry_cmp);
+        for (i = 0; i < entries->nelts && total > target; i++) {
+            zstd_cache_entry_t *e = &APR_ARRAY_IDX(entries, i,
+                                                   zstd_cache_entry_t);
+            if (apr_file_remove(e->path, p) == APR_SUCCESS) {
+                total -= e->size;
+                removed++;
+            }
+        }
+    }
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, sweep->s,
+                 "swept %s: %d of %d entries removed, %" APR_OFF_T_FMT
+                 " bytes left", sweep->root, removed, entries->nelts, total);
+
+    apr_pool_destroy(p);
+    apr_atomic_set32(&cache_sweeping, 0);
+    return NULL;
+}
+
+/*
+ * ZstdCacheMaxSize: account for an entry this child wrote, and have the
+ * cache swept in the background once that makes a share of the limit.
+ */
+static void cache_written_add(server_rec *s, apr_off_t size) {
+
+    zstd_server_config_t *conf = ap_get_module_config(s->module_config,
+                                                      &zstd_module);
+    zstd_cache_sweep_t *sweep;
+    apr_pool_t *pool;
+
+    if (conf->cache_max_size <= 0 || !cache_threads
+        || apr_atomic_add64(&cache_written, (apr_uint64_t)size) + size
+               < (apr_uint64_t)(conf->cache_max_size / ZSTD_CACHE_SWEEP_SHARE)
+        || apr_atomic_cas32(&cache_sweeping, 1, 0) != 0) {
+        return;
+    }
+    apr_atomic_set64(&cache_written, 0);
+
+    if (apr_pool_create_unmanaged_ex(&pool, NULL, NULL) != APR_SUCCESS) {
+        apr_atomic_set32(&cache_sweeping, 0);
+        return;
+    }
+    sweep = apr_pcalloc(pool, sizeof(*sweep));
+    sweep->pool = pool;
+    sweep->s = s;
+    sweep->root = apr_pstrdup(pool, conf->cache_root);
+    sweep->max_size = conf->cache_max_size;
+
+    if (apr_thread_pool_push(cache_threads, cache_sweep, sweep,
+                             APR_THREAD_TASK_PRIORITY_LOWEST, NULL)
+            != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        apr_atomic_set32(&cache_sweeping, 0);
+    }
+}
+
+/*
+ * ZstdCacheMaxSize: an entry sent has its modification time refreshed, at
+ * most every ZSTD_CACHE_TOUCH_SEC, for sweeps to find the least recently
+ * used whether or not the file system keeps access times.
+ */
+static void cache_touch(zstd_server_config_t *conf, const char *path,
+                        const apr_finfo_t *finfo, apr_pool_t *p) {
+
+    apr_time_t now;
+
+    if (conf->cache_max_size <= 0) {
+        return;
+    }
+    now = apr_time_now();
+    if (now - finfo->mtime >= apr_time_from_sec(ZSTD_CACHE_TOUCH_SEC)) {
+        apr_file_mtime_set(path, now, p);
+    }
+}
+
+/* The response did not complete: drop what was written aside */
+static apr_status_t cleanup_cache_file(void *data) {
+
+    zstd_ctx_t *ctx = data;
+
+    if (ctx->cache_file) {
+        apr_file_close(ctx->cache_file);
+        apr_file_remove(ctx->cache_tmp, apr_file_pool_get(ctx->cache_file));
+        ctx->cache_file = NULL;
+        cache_inflight_remove(ctx->cache_key);
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * The frame is complete: make it the cache entry, unless writing it failed
+ * (emit_output() then forgot cache_path).
+ */
+static void cache_commit(zstd_ctx_t *ctx, request_rec *r) {
+
+    apr_status_t rv;
+
+    if (!ctx->cache_file) {
+        return;
+    }
+    if (!ctx->cache_path) {
+        cleanup_cache_file(ctx);
+        return;
+    }
+
+    rv = apr_file_close(ctx->cache_file);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_rename(ctx->cache_tmp, ctx->cache_path, r->pool);
+    }
+    if (rv != APR_SUCCESS) {
+        apr_file_remove(ctx->cache_tmp, r->pool);
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(30345)
+                      "Failed to cache the response as %s", ctx->cache_path);
+    } else {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "cached the response as %s", ctx->cache_path);
+        cache_written_add(r->server, ctx->total_out);
+    }
+    ctx->cache_file = NULL;
+    cache_inflight_remove(ctx->cache_key);
+}
+
+/*
+ * Only complete 200 responses to GET, with a strong entity tag to tell
+ * their versions apart, and that shared caches may store too.
+ */
+static int is_cacheable_response(request_rec *r, apr_bucket_brigade *bb,
+                                 zstd_server_config_t *conf,
+                                 const char *etag) {
+
+    const char *cc;
+
+    if (!conf->cache_root || r->method_number != M_GET || r->header_only
+        || r->status != HTTP_OK || !etag || etag[0] != '"'
+        || is_static_file(r, bb)) {
+        return 0;
+    }
+    cc = apr_table_get(r->headers_out, "Cache-Control");
+    if (cc && (ap_find_token(r->pool, cc, "no-store")
+               || ap_find_token(r->pool, cc, "private"))) {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * ZstdCacheDynamic: send the cached compressed representation of the
+ * entity if there is one. Otherwise, unless another request of this
+ * process is already compressing it (then wait for it a little), have
+ * the compressed output written aside to become the entry.
+ * Returns DECLINED when the response must be compressed now.
+ */
+static apr_status_t send_cached_response(ap_filter_t *f,
+                                         apr_bucket_brigade *bb,
+                                         zstd_ctx_t *ctx,
+                                         zstd_server_config_t *conf,
+                                         const char *etag) {
+
+    request_rec *r = f->r;
+    apr_uint64_t key;
+    const char *path = cache_response_path(r, conf, ctx->dconf, etag, &key);
+    apr_finfo_t finfo;
+    char *dir, *tmp;
+    int leader;
+
+    if (apr_stat(&finfo, path, APR_FINFO_SIZE | APR_FINFO_MTIME
+                 | APR_FINFO_TYPE, r->pool) == APR_SUCCESS
+        && finfo.filetype == APR_REG) {
+        cache_touch(conf, path, &finfo, r->pool);
+        return send_compressed_file(f, bb, conf, path, &finfo, -1, ctx);
+    }
+
+    leader = cache_inflight_add(key);
+    if (!leader) {
+        if (cache_inflight_wait(key,
+                                apr_time_from_msec(ZSTD_CACHE_WAIT_MSEC))
+            && apr_stat(&finfo, path, APR_FINFO_SIZE | APR_FINFO_TYPE,
+                        r->pool) == APR_SUCCESS
+            && finfo.filetype == APR_REG) {
+            return send_compressed_file(f, bb, conf, path, &finfo, -1, ctx);
+        }
+        return DECLINED;
+    }
+
+    dir = apr_pstrdup(r->pool, path);
+    *strrchr(dir, '/') = '\0';
+    tmp = apr_pstrcat(r->pool, path, ".XXXXXX", NULL);
+    if (apr_dir_make_recursive(dir, APR_FPROT_OS_DEFAULT, r->pool)
+            != APR_SUCCESS
+        || apr_file_mktemp(&ctx->cache_file, tmp, APR_FOPEN_CREATE
+                           | APR_FOPEN_WRITE | APR_FOPEN_EXCL
+                           | APR_FOPEN_BINARY | APR_FOPEN_BUFFERED, r->pool)
+               != APR_SUCCESS) {
+        ctx->cache_file = NULL;
+        cache_inflight_remove(key);
+        return DECLINED;
+    }
+    ctx->cache_tmp = tmp;
+    ctx->cache_path = path;
+    ctx->cache_key = key;
+    apr_pool_cleanup_register(r->pool, ctx, cleanup_cache_file,
+                              apr_pool_cleanup_null);
+
+    return DECLINED;
+}
+
+/* Little-endian, as all the integers of zstd frames */
+static char *put_le32(char *p, apr_uint32_t val) {
+
+    p[0] = (char)(val & 0xff);
+    p[1] = (char)((val >> 8) & 0xff);
+    p[2] = (char)((val >> 16) & 0xff);
+    p[3] = (char)((val >> 24) & 0xff);
+    return p + 4;
+}
+
+/*
+ * Append the seek table of the seekable format to the frames: a skippable
+ * frame listing the compressed and decompressed size of each, which
+ * decoders ignore and seekable readers use to decode any range of the
+ * file from the frame it starts in.
+ */
+static apr_status_t write_seek_table(apr_file_t *out,
+                                     const apr_array_header_t *frames,
+                                     apr_pool_t *p) {
+
+    apr_size_t len = 8 + (apr_size_t)frames->nelts * sizeof(apr_uint32_t)
+                     + ZSTD_SEEKABLE_FOOTER_SIZE;
+    char *table = apr_palloc(p, len);
+    char *cur = table;
+    int i;
+
+    cur = put_le32(cur, ZSTD_SEEKABLE_SKIPPABLE_MAGIC);
+    cur = put_le32(cur, (apr_uint32_t)(len - 8));
+    for (i = 0; i < frames->nelts; i++) {
+        cur = put_le32(cur, APR_ARRAY_IDX(frames, i, apr_uint32_t));
+    }
+    cur = put_le32(cur, (apr_uint32_t)(frames->nelts / 2));
+    *cur++ = 0;     /* descriptor: no checksums */
+    put_le32(cur, ZSTD_SEEKABLE_MAGIC);
+
+    return apr_file_write_full(out, table, len, NULL);
+}
+
+static apr_status_t compress_file(zstd_cache_job_t *job, apr_file_t *in,
+                                  apr_file_t *out) {
+
+    apr_size_t in_size = ZSTD_CStreamInSize();
+    apr_size_t out_size = ZSTD_CStreamOutSize();
+    char *in_buf = apr_palloc(job->pool, in_size);
+    char *out_buf = apr_palloc(job->pool, out_size);
+    ZSTD_CCtx *cctx;
+    apr_status_t rv = APR_SUCCESS;
+    apr_off_t total = 0;
+    size_t remaining;
+    /* With ZstdCacheFrameSize, each frame is pledged its own size */
+    apr_off_t frame_size = job->frame_size ? job->frame_size : job->size;
+    apr_off_t frame_in = 0, frame_out = 0;
+    apr_array_header_t *frames = NULL;
+
+    cctx = ZSTD_createCCtx();
+    if (!cctx) {
+        return APR_ENOMEM;
+    }
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, job->level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog,
+                           browser_window_log(job->level, 0, 0));
+    ZSTD_CCtx_setPledgedSrcSize(cctx, (job->size < frame_size) ? job->size
+                                                               : frame_size);
+    if (job->frame_size) {
+        frames = apr_array_make(job->pool,
+                                (int)(job->size / frame_size + 1) * 2,
+                                sizeof(apr_uint32_t));
+    }
+
+    do {
+        apr_size_t len = in_size;
+        ZSTD_EndDirective mode = ZSTD_e_continue;
+        ZSTD_inBuffer input;
+        int last = 0;
+
+        if ((apr_off_t)len > frame_size - frame_in) {
+            len = (apr_size_t)(frame_size - frame_in);
+        }
+        rv = apr_file_read_full(in, in_buf, len, &len);
+        if (rv == APR_EOF || total + (apr_off_t)len == job->size) {
+            mode = ZSTD_e_end;
+            last = 1;
+            rv = APR_SUCCESS;
+        } else if (rv != APR_SUCCESS) {
+            break;
+        } else if (frame_in + (apr_off_t)len == frame_size) {
+            mode = ZSTD_e_end;
+        }
+        total += len;
+        frame_in += len;
+
+        input.src = in_buf;
+        input.size = len;
+        input.pos = 0;
+        do {
+            ZSTD_outBuffer output = { out_buf, out_size, 0 };
+
+            remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+            if (ZSTD_isError(remaining)) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, job->s, APLOGNO(30311)
+                             "Error while compressing %s: %s", job->source,
+                             ZSTD_getErrorName(remaining));
+                rv = APR_EGENERAL;
+                break;
+            }
+            frame_out += output.pos;
+            rv = apr_file_write_full(out, out_buf, output.pos, NULL);
+        } while (rv == APR_SUCCESS
+                 && ((mode == ZSTD_e_end && remaining)
+                     || input.pos != input.size));
+
+        if (rv == APR_SUCCESS && mode == ZSTD_e_end) {
+            if (frames) {
+                APR_ARRAY_PUSH(frames, apr_uint32_t) = (apr_uint32_t)frame_out;
+                APR_ARRAY_PUSH(frames, apr_uint32_t) = (apr_uint32_t)frame_in;
+            }
+            if (last) {
+                break;
+            }
+            frame_in = frame_out = 0;
+            ZSTD_CCtx_setPledgedSrcSize(cctx,
+                                        (job->size - total < frame_size)
+                                        ? job->size - total : frame_size);
+        }
+    } while (rv == APR_SUCCESS);
+
+    if (rv == APR_SUCCESS && frames) {
+        rv = write_seek_table(out, frames, job->pool);
+    }
+
+    ZSTD_freeCCtx(cctx);
+    return rv;
+}
+
+static void *APR_THREAD_FUNC cache_job(apr_thread_t *thd, void *data) {
+
+    zstd_cache_job_t *job = data;
+    char *dir, *tmp;
+    apr_file_t *in, *out;
+    apr_status_t rv;
+
+    dir = apr_pstrdup(job->pool, job->target);
+    *strrchr(dir, '/') = '\0';
+    rv = apr_dir_make_recursive(dir, APR_FPROT_OS_DEFAULT, job->pool);
+
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_open(&in, job->source,
+                           APR_FOPEN_READ | APR_FOPEN_BINARY,
+                           APR_FPROT_OS_DEFAULT, job->pool);
+    }
+    if (rv == APR_SUCCESS) {
+        /* Written aside and renamed once complete, so that requests never
+         * see a partial file.
+         */
+        tmp = apr_pstrcat(job->pool, job->target, ".XXXXXX", NULL);
+        rv = apr_file_mktemp(&out, tmp, APR_FOPEN_CREATE | APR_FOPEN_WRITE
+                                        | APR_FOPEN_EXCL | APR_FOPEN_BINARY
+                                        | APR_FOPEN_BUFFERED, job->pool);
+        if (rv == APR_SUCCESS) {
+            rv = compress_file(job, in, out);
+            apr_file_close(out);
+            if (rv == APR_SUCCESS) {
+                rv = apr_file_rename(tmp, job->target, job->pool);
+            }
+            if (rv != APR_SUCCESS) {
+                apr_file_remove(tmp, job->pool);
+            }
+        }
+        apr_file_close(in);
+    }
+
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, job->s, APLOGNO(30313)
+                     "Failed to cache %s as %s", job->source, job->target);
+    } else {
+        apr_finfo_t finfo;
+
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, job->s,
+                     "cached %s as %s", job->source, job->target);
+        if (apr_stat(&finfo, job->target, APR_FINFO_SIZE, job->pool)
+                == APR_SUCCESS) {
+            cache_written_add(job->s, finfo.size);
+        }
+    }
+
+    cache_inflight_remove(job->key);
+    apr_pool_destroy(job->pool);
+    return NULL;
+}
+
+/*
+ * Send the cached representation of the requested static file if there is
+ * one, otherwise have it compressed in the background for the next
+ * requests. Returns DECLINED when the response must be compressed now.
+ */
+static apr_status_t send_cached_file(ap_filter_t *f, apr_bucket_brigade *bb,
+                                     zstd_server_config_t *conf) {
+
+    request_rec *r = f->r;
+    int level = (conf->cache_level != ZSTD_UNSET) ? conf->cache_level
+                                                  : ZSTD_DEFAULT_CACHE_LEVEL;
+    apr_off_t frame_size = (conf->cache_frame_size != ZSTD_UNSET)
+                           ? conf->cache_frame_size : 0;
+    apr_uint64_t key = cache_key(r, level, frame_size);
+    const char *path;
+    apr_finfo_t finfo;
+    zstd_cache_job_t *job;
+    apr_pool_t *pool;
+
+    path = cache_path(r->pool, conf, key);
+
+    if (apr_stat(&finfo, path, APR_FINFO_SIZE | APR_FINFO_MTIME
+                 | APR_FINFO_TYPE, r->pool) == APR_SUCCESS
+        && finfo.filetype == APR_REG) {
+        cache_touch(conf, path, &finfo, r->pool);
+        return send_compressed_file(f, bb, conf, path, &finfo,
+                                    r->finfo.size, NULL);
+    }
+
+    if (!cache_threads || !cache_inflight_add(key)) {
+        return DECLINED;
+    }
+
+    if (apr_pool_create_unmanaged_ex(&pool, NULL, NULL) != APR_SUCCESS) {
+        cache_inflight_remove(key);
+        return DECLINED;
+    }
+    job = apr_pcalloc(pool, sizeof(*job));
+    job->pool = pool;
+    job->s = r->server;
+    job->source = apr_pstrdup(pool, r->filename);
+    job->target = apr_pstrdup(pool, path);
+    job->key = key;
+    job->size = r->finfo.size;
+    job->level = level;
+    job->frame_size = frame_size;
+
+    if (apr_thread_pool_push(cache_threads, cache_job, job,
+                             APR_THREAD_TASK_PRIORITY_LOWEST, NULL)
+            != APR_SUCCESS) {
+        cache_inflight_remove(key);
+        apr_pool_destroy(pool);
+    }
+
+    return DECLINED;
+}
+#endif
+
+/*
+ * Whether the client asks for byte ranges of the full response, which the
+ * byterange filter would cut from the representation sent.
+ */
+static int is_range_request(request_rec *r) {
+
+    const char *range;
+
+    if (r->method_number != M_GET || r->header_only
+        || r->status != HTTP_OK) {
+        return 0;
+    }
+    range = apr_table_get(r->headers_in, "Range");
+    return range && ap_cstr_casecmpn(range, "bytes=", 6) == 0;
+}
+
+/*
+ * Send an already compressed representation of a static file: a ".zst"
+ * sidecar at least as recent as the file itself, or a cached one.
+ * Returns DECLINED when there is none.
+ */
+static apr_status_t send_precompressed(ap_filter_t *f, apr_bucket_brigade *bb,
+                                       zstd_server_config_t *conf,
+                                       const zstd_dir_config_t *dconf) {
+
+    request_rec *r = f->r;
+
+    if (!is_static_file(r, bb)) {
+        return DECLINED;
+    }
+
+    if (dconf->precompressed) {
+        const char *path = apr_pstrcat(r->pool, r->filename, ".zst", NULL);
+        apr_finfo_t finfo;
+
+        if (apr_stat(&finfo, path, APR_FINFO_SIZE | APR_FINFO_MTIME
+                     | APR_FINFO_TYPE, r->pool) == APR_SUCCESS
+            && finfo.filetype == APR_REG
+            && finfo.mtime >= r->finfo.mtime) {
+            return send_compressed_file(f, bb, conf, path, &finfo,
+                                        r->finfo.size, NULL);
+        }
+    }
+
+#if APR_HAS_THREADS
+    if (conf->cache_root) {
+        return send_cached_file(f, bb, conf);
+    }
+#endif
+
+    return DECLINED;
+}
+
+/* ZstdFilterNote: leave the notes configured for logging */
+static void leave_notes(const zstd_ctx_t *ctx, zstd_server_config_t *conf,
+                        request_rec *r) {
+
+    const char *const *names = conf->note_names;
+
+    if (names[FILTER_NOTE_RATIO]) {
+        if (ctx->total_in > 0) {
+            int ratio = (int) (ctx->total_out * 100 / ctx->total_in);
+
+            apr_table_setn(r->notes, names[FILTER_NOTE_RATIO],
+                           apr_itoa(r->pool, ratio));
+        } else {
+            apr_table_setn(r->notes, names[FILTER_NOTE_RATIO], "-");
+        }
+    }
+    if (names[FILTER_NOTE_INPUT]) {
+        apr_table_setn(r->notes, names[FILTER_NOTE_INPUT],
+                       apr_off_t_toa(r->pool, ctx->total_in));
+    }
+    if (names[FILTER_NOTE_OUTPUT]) {
+        apr_table_setn(r->notes, names[FILTER_NOTE_OUTPUT],
+                       apr_off_t_toa(r->pool, ctx->total_out));
+    }
+    if (names[FILTER_NOTE_TIME]) {
+        apr_table_setn(r->notes, names[FILTER_NOTE_TIME],
+                       apr_psprintf(r->pool, "%" APR_INT64_T_FMT,
+                                    ctx->compress_usec));
+    }
+    if (names[FILTER_NOTE_CPU]) {
+        apr_table_setn(r->notes, names[FILTER_NOTE_CPU],
+                       apr_psprintf(r->pool, "%" APR_INT64_T_FMT,
+                                    ctx->cpu_usec));
+    }
+    if (names[FILTER_NOTE_CALLS]) {
+        apr_table_setn(r->notes, names[FILTER_NOTE_CALLS],
+                       apr_itoa(r->pool, ctx->calls));
+    }
+    if (names[FILTER_NOTE_FLUSHES]) {
+        apr_table_setn(r->notes, names[FILTER_NOTE_FLUSHES],
+                       apr_itoa(r->pool, ctx->flushes));
+    }
+    if (names[FILTER_NOTE_BUFFERED]) {
+        apr_table_setn(r->notes, names[FILTER_NOTE_BUFFERED],
+                       apr_off_t_toa(r->pool,
+                                     (apr_off_t)ctx->max_pending_out));
+    }
+    if (names[FILTER_NOTE_POOL]) {
+        apr_table_setn(r->notes, names[FILTER_NOTE_POOL],
+                       ctx->pool_hit ? "hit" : "miss");
+    }
+    if (names[FILTER_NOTE_LEVEL]) {
+        apr_table_setn(r->notes, names[FILTER_NOTE_LEVEL],
+                       apr_itoa(r->pool, ctx->params.compression_level));
+    }
+    if (names[FILTER_NOTE_WORKERS]) {
+        apr_table_setn(r->notes, names[FILTER_NOTE_WORKERS],
+                       apr_itoa(r->pool, ctx->params.workers));
+    }
+}
+
+static apr_status_t compress_filter(ap_filter_t *f, apr_bucket_brigade *bb) {
+
+    request_rec *r = f->r;
+    zstd_ctx_t *ctx = f->ctx;
+    apr_status_t rv;
+    zstd_server_config_t *conf;
+    const zstd_dir_config_t *dconf;
+    apr_time_t arrived = 0;
+
+    if (APR_BRIGADE_EMPTY(bb)) {
+        return APR_SUCCESS;
+    }
+
+    conf = ap_get_module_config(r->server->module_config, &zstd_module);
+    dconf = ctx ? ctx->dconf : get_dir_config(r);
+
+    if (ctx && ctx->cached) {
+        apr_brigade_cleanup(bb);
+        return APR_SUCCESS;
+    }
+
+    if (!ctx) {
+        const char *encoding;
+        const char *token;
+        const char *coding;
+        const zstd_dict_t *dict = NULL;
+        const zstd_accept_t *acc;
+
+        if (conf->dictionaries && !r->main) {
+            advertise_dictionary(r, conf);
+        }
+
+        /* Only work on main request, not subrequests, where compression
+         * is not turned off, that are not a 204 response with no content,
+         * and are not tagged with the no-zstd env variable, and are not a
+         * partial response to a Range request.
+         *
+         * Note that responding to 304 is handled separately to set
+         * the required headers (such as ETag) per RFC7232, 4.1.
+         */
+        if (r->main || !dconf->enabled || r->status == HTTP_NO_CONTENT
+            || apr_table_get(r->subprocess_env, "no-zstd")
+            || apr_table_get(r->headers_out, "Content-Range")) {
+            stats_skip(r, conf, ZSTD_SKIP_INELIGIBLE);
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+
+        /* Let's see what our current Content-Encoding is. */
+        encoding = get_content_encoding(r);
+        if (encoding) {
+            const char *tmp = encoding;
+            token = ap_get_token(r->pool, &tmp, 0);
+            while (token && *token) {
+                if (strcmp(token, "identity") != 0 &&
+                    strcmp(token, "7bit") != 0 &&
+                    strcmp(token, "8bit") != 0 &&
+                    strcmp(token, "binary") != 0) {
+                    /* The data is already encoded, do nothing: by the
+                     * ZstdPreference pick if it is its coding.
+                     */
+                    const char *pick = apr_table_get(r->notes,
+                                                     ZSTD_NOTE_CODING);
+
+                    stats_skip(r, conf,
+                               pick && ap_cstr_casecmp(token, pick) == 0
+                               ? ZSTD_SKIP_PREFERENCE : ZSTD_SKIP_ENCODED);
+                    ap_remove_output_filter(f);
+                    return ap_pass_brigade(f->next, bb);
+                }
+                if (*tmp) {
+                    ++tmp;
+                }
+                token = (*tmp) ? ap_get_token(r->pool, &tmp, 0) : NULL;
+            }
+        }
+
+        /* Even if we don't accept this request based on it not having
+         * the Accept-Encoding, we need to note that we were looking
+         * for this header and downstream proxies should be aware of
+         * that.
+         */
+        apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+        if (conf->dictionaries) {
+            apr_table_mergen(r->headers_out, "Vary", "Available-Dictionary");
+        }
+        acc = get_accept(r);
+        if (!accept_q(acc, ZSTD_CODING_ZSTD)) {
+            stats_skip(r, conf, ZSTD_SKIP_NOT_ACCEPTED);
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+
+        /* Do we have Accept-Encoding: dcz too, with a dictionary of ours? */
+        if (conf->dictionaries) {
+            dict = find_dictionary(r, conf);
+        }
+        if (dict && accept_q(acc, ZSTD_CODING_DCZ)) {
+            coding = "dcz";
+        } else {
+            coding = "zstd";
+            dict = NULL;
+        }
+
+        ctx = apr_pcalloc(r->pool, sizeof(*ctx));
+        ctx->dconf = dconf;
+        ctx->dict = dict;
+        ctx->coding = coding;
+        f->ctx = ctx;
+    }
+
+    if (!ctx->bb) {
+        const char *encoding;
+        const char *coding = ctx->coding;
+        const char *etag;
+        const char *identity_encoding, *identity_length;
+        const char *content_encoding = r->content_encoding;
+        zstd_skip_e fallback = ZSTD_SKIP_MAX;
+        apr_off_t size_hint;
+        int exact;
+
+        if (ctx->held) {
+            APR_BRIGADE_PREPEND(bb, ctx->held);
+        }
+
+        /* Not worth it for bodies too small, or already compressed. A 304
+         * or a HEAD has no body, but must have the headers of what it
+         * stands for. A stream is neither held nor probed: its first
+         * event tells nothing of the next ones, and must not wait.
+         */
+        ctx->streaming = is_stream_response(r, dconf);
+        if (r->status != HTTP_NOT_MODIFIED && !r->header_only
+            && !ctx->streaming) {
+            zstd_skip_e reason = ZSTD_SKIP_TOO_SMALL;
+
+            rv = check_body_size(r, bb, dconf, &reason);
+            if (rv == APR_INCOMPLETE) {
+                return ap_save_brigade(f, &ctx->held, &bb, r->pool);
+            }
+            if (rv == OK && dconf->probe
+                && !(is_static_file(r, bb)
+                     && (dconf->precompressed || conf->cache_root))
+                && looks_incompressible(bb)) {
+                reason = ZSTD_SKIP_INCOMPRESSIBLE;
+                rv = DECLINED;
+            }
+            if (rv == DECLINED) {
+                stats_skip(r, conf, reason);
+                ap_remove_output_filter(f);
+                return ap_pass_brigade(f->next, bb);
+            }
+        }
+
+        /* Kept to fall back to the identity response, see below */
+        identity_encoding = apr_table_get(r->headers_out, "Content-Encoding");
+        identity_length = apr_table_get(r->headers_out, "Content-Length");
 
         /* If the entire Content-Encoding is "identity", we can replace it. */
+        encoding = get_content_encoding(r);
         if (!encoding || ap_cstr_casecmp(encoding, "identity") == 0) {
-            apr_table_setn(r->headers_out, "Content-Encoding", "zstd");
+            apr_table_setn(r->headers_out, "Content-Encoding", coding);
         } else {
-            apr_table_mergen(r->headers_out, "Content-Encoding", "zstd");
+            apr_table_mergen(r->headers_out, "Content-Encoding", coding);
         }
         if (r->content_encoding) {
             r->content_encoding = apr_table_get(r->headers_out,
                                                 "Content-Encoding");
         }
+        size_hint = get_body_size(r, bb, &exact);
         apr_table_unset(r->headers_out, "Content-Length");
         apr_table_unset(r->headers_out, "Content-MD5");
+        etag = apr_table_get(r->headers_out, "ETag");
 
         /* https://bz.apache.org/bugzilla/show_bug.cgi?id=39727
          * https://bz.apache.org/bugzilla/show_bug.cgi?id=45023
@@ -348,31 +3991,94 @@ static apr_status_t compress_filter(ap_filter_t *f, apr_bucket_brigade *bb) {
          * DeflateAlterETag with BrotliAlterETag to keep the transition from
          * mod_deflate seamless.
          */
-        if (conf->etag_mode == ETAG_MODE_REMOVE) {
+        if (dconf->etag_mode == ETAG_MODE_REMOVE) {
             apr_table_unset(r->headers_out, "ETag");
-        } else if (conf->etag_mode == ETAG_MODE_ADDSUFFIX) {
-            const char *etag = apr_table_get(r->headers_out, "ETag");
+        } else if (dconf->etag_mode == ETAG_MODE_ADDSUFFIX && etag) {
+            apr_size_t len = strlen(etag);
+
+            if (len > 2 && etag[len - 1] == '"') {
+                const char *tagged = apr_pstrmemdup(r->pool, etag, len - 1);
+
+                tagged = apr_pstrcat(r->pool, tagged, "-", coding, "\"",
+                                     NULL);
+                apr_table_setn(r->headers_out, "ETag", tagged);
+            }
+        }
+
+        /* For 304 responses, we only need to send out the headers. */
+        if (r->status == HTTP_NOT_MODIFIED) {
+            stand_down_encoders(r, dconf);
+            stats_skip(r, conf, ZSTD_SKIP_NOT_MODIFIED);
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+
+        if (!ctx->dict && (dconf->precompressed || conf->cache_root)) {
+            rv = send_precompressed(f, bb, conf, dconf);
+            if (rv != DECLINED) {
+                stand_down_encoders(r, dconf);
+                return rv;
+            }
+        }
+
+#if APR_HAS_THREADS
+        if (dconf->cache_dynamic && cache_cond && !ctx->dict
+            && is_cacheable_response(r, bb, conf, etag)) {
+            rv = send_cached_response(f, bb, ctx, conf, etag);
+            if (rv != DECLINED) {
+                stand_down_encoders(r, dconf);
+                return rv;
+            }
+        }
+#endif
+
+        /* The byterange filter only cuts bodies it has whole, which one
+         * compressed on the fly is not: rather than all of it, send the
+         * range of the identity response. Once compressed in ZstdCacheRoot,
+         * ranges of the zstd representation are served above.
+         *
+         * The identity response is sent too when no context can be had,
+         * ZstdMaxMemory leaving no room for one or zstd failing to set it
+         * up.
+         */
+        if (is_range_request(r) && !ctx->cache_file) {
+            fallback = ZSTD_SKIP_RANGE;
+        } else if ((fallback = start_ctx(ctx, conf, size_hint, exact,
+                                         f->c->bucket_alloc, r->pool,
+                                         f->r)) != ZSTD_SKIP_MAX) {
+#if APR_HAS_THREADS
+            apr_pool_cleanup_run(r->pool, ctx, cleanup_cache_file);
+#endif
+        }
+        if (fallback != ZSTD_SKIP_MAX) {
+            if (identity_encoding) {
+                apr_table_setn(r->headers_out, "Content-Encoding",
+                               identity_encoding);
+            } else {
+                apr_table_unset(r->headers_out, "Content-Encoding");
+            }
+            r->content_encoding = content_encoding;
+            if (identity_length) {
+                apr_table_setn(r->headers_out, "Content-Length",
+                               identity_length);
+            }
             if (etag) {
-                apr_size_t len = strlen(etag);
-
-                if (len > 2 && etag[len - 1] == '"') {
-                    etag = apr_pstrmemdup(r->pool, etag, len - 1);
-                    etag = apr_pstrcat(r->pool, etag, "-zstd\"", NULL);
-                    apr_table_setn(r->headers_out, "ETag", etag);
-                }
+                apr_table_setn(r->headers_out, "ETag", etag);
             }
-        }
-
-        /* For 304 responses, we only need to send out the headers. */
-        if (r->status == HTTP_NOT_MODIFIED) {
+            stats_skip(r, conf, fallback);
             ap_remove_output_filter(f);
             return ap_pass_brigade(f->next, bb);
         }
+        stand_down_encoders(r, dconf);
+    }
 
-        ctx = create_ctx(conf,f->c->bucket_alloc, r->pool, f->r);
-        f->ctx = ctx;
+    if (dconf->flush_policy == FLUSH_POLICY_AUTO
+        || dconf->flush_policy == FLUSH_POLICY_MS) {
+        arrived = apr_time_now();
     }
 
+    cpu_sample_start(ctx);
+
     apr_bucket *e;
     while ((e = APR_BRIGADE_FIRST(bb)) != APR_BRIGADE_SENTINEL(bb)) {
 
@@ -390,28 +4096,16 @@ static apr_status_t compress_filter(ap_filter_t *f, apr_bucket_brigade *bb) {
 
         if (APR_BUCKET_IS_EOS(e)) {
             rv = process_bucket(ctx, ZSTD_e_end, NULL, 0, f);
+            cpu_sample_stop(ctx);
             if (rv != APR_SUCCESS) {
                 return rv;
             }
-            /* Leave notes for logging. */
-            if (conf->note_input_name) {
-                apr_table_setn(r->notes, conf->note_input_name,
-                               apr_off_t_toa(r->pool, ctx->total_in));
-            }
-            if (conf->note_output_name) {
-                apr_table_setn(r->notes, conf->note_output_name,
-                               apr_off_t_toa(r->pool, ctx->total_out));
-            }
-            if (conf->note_ratio_name) {
-                if (ctx->total_in > 0) {
-                    int ratio = (int) (ctx->total_out * 100 / ctx->total_in);
-
-                    apr_table_setn(r->notes, conf->note_ratio_name,
-                                   apr_itoa(r->pool, ratio));
-                } else {
-                    apr_table_setn(r->notes, conf->note_ratio_name, "-");
-                }
-            }
+#if APR_HAS_THREADS
+            cache_commit(ctx, r);
+#endif
+            leave_notes(ctx, conf, r);
+            ZSTD_PROBE4(compress__done, r->uri, ctx->total_in,
+                        ctx->total_out, ctx->cpu_usec);
 
             APR_BUCKET_REMOVE(e);
             APR_BRIGADE_INSERT_TAIL(ctx->bb, e);
@@ -420,27 +4114,31 @@ static apr_status_t compress_filter(ap_filter_t *f, apr_bucket_brigade *bb) {
             apr_brigade_cleanup(ctx->bb);
             apr_pool_cleanup_run(r->pool, ctx, cleanup_ctx);
             ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                          "%s [c:%d w:%d] %s:%d %s:%d %s:%d",
+                          "%s [c:%d w:%d] in:%" APR_OFF_T_FMT
+                          " out:%" APR_OFF_T_FMT " ratio:%d cpu:%"
+                          APR_INT64_T_FMT "us",
                           r->the_request,
-                          conf->compression_level, conf->workers,
-                          conf->note_input_name, ctx->total_in,
-                          conf->note_output_name, ctx->total_out,
-                          conf->note_ratio_name, 
-                          (int) (ctx->total_out * 100 / ctx->total_in));
+                          ctx->params.compression_level, ctx->params.workers,
+                          ctx->total_in, ctx->total_out,
+                          ctx->total_in ? (int) (ctx->total_out * 100
+                                                 / ctx->total_in) : 0,
+                          ctx->cpu_usec);
             return rv;
 
         } else if (APR_BUCKET_IS_FLUSH(e)) {
-            /* TODO Check - seems useless as last chunk was already flushed */
-            rv = process_bucket(ctx, ZSTD_e_flush, NULL, 0, f);
-            if (rv != APR_SUCCESS) {
-                return rv;
+            if (ctx->unflushed_in) {
+                rv = process_bucket(ctx, ZSTD_e_flush, NULL, 0, f);
+                if (rv != APR_SUCCESS) {
+                    return rv;
+                }
+                ctx->unflushed_in = 0;
+                ctx->last_flush = apr_time_now();
             }
 
             APR_BUCKET_REMOVE(e);
             APR_BRIGADE_INSERT_TAIL(ctx->bb, e);
 
-            rv = ap_pass_brigade(f->next, ctx->bb);
-            apr_brigade_cleanup(ctx->bb);
+            rv = pass_output(ctx, f, 0);
             if (rv != APR_SUCCESS) {
                 return rv;
             }
@@ -453,26 +4151,418 @@ static apr_status_t compress_filter(ap_filter_t *f, apr_bucket_brigade *bb) {
             const char *data;
             apr_size_t len;
 
+            if (APR_BUCKET_IS_FILE(e)) {
+                prepare_file_bucket(e);
+            }
+
+            /* Data not there yet (from a backend, a CGI) is waited for
+             * only once the client has what is compressed so far, unless
+             * the flush policy favours ratio.
+             */
             // https://apr.apache.org/docs/apr/2.0/group___a_p_r___util___bucket___brigades.html#gae44ae938c6c60e148430fdb098dcf28f
-            rv = apr_bucket_read(e, &data, &len, APR_BLOCK_READ);
+            rv = apr_bucket_read(e, &data, &len, APR_NONBLOCK_READ);
+            if (APR_STATUS_IS_EAGAIN(rv)) {
+                if ((ctx->unflushed_in || !APR_BRIGADE_EMPTY(ctx->bb))
+                    && (ctx->streaming
+                        || (dconf->flush_policy != FLUSH_POLICY_EOS
+                            && dconf->flush_policy != FLUSH_POLICY_BYTES))) {
+                    rv = flush_to_client(ctx, f);
+                    if (rv != APR_SUCCESS) {
+                        return rv;
+                    }
+                }
+                rv = apr_bucket_read(e, &data, &len, APR_BLOCK_READ);
+            }
             if (rv != APR_SUCCESS) {
                 return rv;
             }
 
-            rv = process_bucket(ctx, ZSTD_e_flush, data, len, f);
+            if (dconf->flush_policy == FLUSH_POLICY_BUCKET) {
+                rv = process_bucket(ctx, ZSTD_e_flush, data, len, f);
+                ctx->unflushed_in = 0;
+            } else {
+                rv = process_bucket(ctx, ZSTD_e_continue, data, len, f);
+            }
+            apr_bucket_delete(e);
             if (rv != APR_SUCCESS) {
                 return rv;
             }
 
-            rv = ap_pass_brigade(f->next, ctx->bb);
-            apr_brigade_cleanup(ctx->bb);
+            if (dconf->flush_policy == FLUSH_POLICY_BUCKET) {
+                rv = pass_output(ctx, f, 0);
+            } else if (dconf->flush_policy == FLUSH_POLICY_BYTES
+                       && ctx->unflushed_in >= dconf->flush_threshold) {
+                rv = pass_output(ctx, f, 1);
+            } else if (ctx->pending_out >= ctx->out_size) {
+                rv = pass_output(ctx, f, 0);
+            }
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+        }
+    }
+
+    /* The brigade ended without EOS: decide whether the client should get
+     * what was compressed so far, or wait for more input to improve ratio.
+     * In auto mode, a brigade arriving after an idle gap means the content
+     * is produced slowly (or streamed), so latency wins over ratio.
+     *
+     * A stream may be idle for long after any brigade, and there is no
+     * timer to flush what would be left in the context meanwhile: it is
+     * flushed before the handler gets control back.
+     */
+    if (ctx->streaming) {
+        if (ctx->unflushed_in || ctx->pending_out) {
+            rv = flush_to_client(ctx, f);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+        }
+    } else if (dconf->flush_policy == FLUSH_POLICY_AUTO
+        || dconf->flush_policy == FLUSH_POLICY_MS) {
+        apr_time_t now = apr_time_now();
+        apr_time_t since = (dconf->flush_policy == FLUSH_POLICY_AUTO)
+                           ? ctx->last_seen : ctx->last_flush;
+
+        if (ctx->unflushed_in
+            && arrived - since >= apr_time_from_msec(dconf->flush_threshold)) {
+            rv = pass_output(ctx, f, 1);
             if (rv != APR_SUCCESS) {
                 return rv;
             }
+        }
+        ctx->last_seen = now;
+    }
+    cpu_sample_stop(ctx);
+    return APR_SUCCESS;
+}
+
+static apr_status_t cleanup_inflate_ctx(void *data) {
+
+    zstd_inflate_ctx_t *ctx = data;
+
+    if (ctx->dctx) {
+        dctx_pool_put(ctx->dctx);
+        ctx->dctx = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static zstd_inflate_ctx_t *create_inflate_ctx(ap_filter_t *f,
+                                              const zstd_dir_config_t *dconf,
+                                              apr_off_t limit) {
+
+    request_rec *r = f->r;
+    zstd_inflate_ctx_t *ctx = apr_pcalloc(r->pool, sizeof(*ctx));
+
+    ctx->dctx = dctx_pool_get(dconf, r);
+    if (!ctx->dctx) {
+        return NULL;
+    }
+    apr_pool_cleanup_register(r->pool, ctx, cleanup_inflate_ctx,
+                              apr_pool_cleanup_null);
+
+    ctx->dconf = dconf;
+    ctx->bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
+    ctx->proc_bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
+    ctx->limit = limit;
+    ctx->hint = 1;
+
+    return ctx;
+}
+
+/*
+ * Decompress data into heap buckets appended to ctx->proc_bb. Output is
+ * checked against ZstdMaxInflateLimit and ZstdMaxInflateRatio as it grows,
+ * so that a bomb is stopped after at most one more ZSTD_DStreamOutSize().
+ */
+static apr_status_t inflate_data(zstd_inflate_ctx_t *ctx, const char *data,
+                                 apr_size_t len, request_rec *r) {
+
+    apr_bucket_alloc_t *alloc = ctx->proc_bb->bucket_alloc;
+    apr_size_t out_size = ZSTD_DStreamOutSize();
+    ZSTD_inBuffer input = { data, len, 0 };
+    int full;
+
+    ctx->total_in += len;
+
+    do {
+        ZSTD_outBuffer out = { apr_bucket_alloc(out_size, alloc), out_size,
+                               0 };
+
+        ctx->hint = ZSTD_decompressStream(ctx->dctx, &out, &input);
+        if (ZSTD_isError(ctx->hint)) {
+            apr_bucket_free(out.dst);
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30333)
+                          "Error while decompressing: %s",
+                          ZSTD_getErrorName(ctx->hint));
+            return APR_EGENERAL;
+        }
+        if (out.pos) {
+            APR_BRIGADE_INSERT_TAIL(ctx->proc_bb,
+                                    apr_bucket_heap_create(out.dst, out.pos,
+                                                           apr_bucket_free,
+                                                           alloc));
+        } else {
+            apr_bucket_free(out.dst);
+        }
+        ctx->total_out += out.pos;
+        full = (out.pos == out.size);
+
+        if (ctx->limit && ctx->total_out > ctx->limit) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30335)
+                          "Decompressed body larger than the limit of %"
+                          APR_OFF_T_FMT " bytes", ctx->limit);
+            return APR_ENOSPC;
+        }
+        if (ctx->dconf->inflate_ratio
+            && ctx->total_out > ZSTD_INFLATE_RATIO_MIN_SIZE
+            && ctx->total_out / ctx->total_in > ctx->dconf->inflate_ratio) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30337)
+                          "Decompressed body above ZstdMaxInflateRatio %d "
+                          "(%" APR_OFF_T_FMT " bytes from %" APR_OFF_T_FMT
+                          ")", ctx->dconf->inflate_ratio, ctx->total_out,
+                          ctx->total_in);
+            return APR_ENOSPC;
+        }
+    } while (input.pos < input.size || full);
+
+    return APR_SUCCESS;
+}
+
+/* At EOS: the data must end with a complete frame, unless there is none */
+static apr_status_t inflate_finish(zstd_inflate_ctx_t *ctx, request_rec *r) {
+
+    if (ctx->total_in && ctx->hint) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(30339)
+                      "Truncated zstd data (%" APR_OFF_T_FMT " bytes)",
+                      ctx->total_in);
+        return APR_EGENERAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Input filter decompressing request bodies sent with
+ * "Content-Encoding: zstd", for handlers and backends to get them as is.
+ */
+static apr_status_t decompress_in_filter(ap_filter_t *f,
+                                         apr_bucket_brigade *bb,
+                                         ap_input_mode_t mode,
+                                         apr_read_type_e block,
+                                         apr_off_t readbytes) {
+
+    request_rec *r = f->r;
+    zstd_inflate_ctx_t *ctx = f->ctx;
+    apr_status_t rv;
+    apr_bucket *e;
+
+    /* just get out of the way of things we don't want. */
+    if (mode != AP_MODE_READBYTES) {
+        return ap_get_brigade(f->next, bb, mode, block, readbytes);
+    }
+
+    if (!ctx) {
+        const zstd_dir_config_t *dconf;
+        const char *encoding;
+
+        /* only work on main request/no subrequests */
+        encoding = apr_table_get(r->headers_in, "Content-Encoding");
+        if (!ap_is_initial_req(r) || !encoding
+            || ap_cstr_casecmp(encoding, "zstd") != 0) {
+            ap_remove_input_filter(f);
+            return ap_get_brigade(f->next, bb, mode, block, readbytes);
+        }
+
+        /* LimitRequestBody applies to what reaches us, compressed, so
+         * it is what bounds the decompressed body too unless configured.
+         */
+        dconf = get_dir_config(r);
+        ctx = create_inflate_ctx(f, dconf, dconf->inflate_limit
+                                           ? dconf->inflate_limit
+                                           : ap_get_limit_req_body(r));
+        if (!ctx) {
+            return APR_ENOMEM;
+        }
+        f->ctx = ctx;
+
+        apr_table_unset(r->headers_in, "Content-Encoding");
+        apr_table_unset(r->headers_in, "Content-Length");
+        apr_table_unset(r->headers_in, "Content-MD5");
+    }
+
+    while (APR_BRIGADE_EMPTY(ctx->proc_bb) && !ctx->done) {
+        rv = ap_get_brigade(f->next, ctx->bb, mode, block, readbytes);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        if (APR_BRIGADE_EMPTY(ctx->bb)) {
+            return APR_SUCCESS;
+        }
+
+        while ((e = APR_BRIGADE_FIRST(ctx->bb))
+               != APR_BRIGADE_SENTINEL(ctx->bb)) {
+            const char *data;
+            apr_size_t len;
+
+            if (APR_BUCKET_IS_EOS(e)) {
+                rv = inflate_finish(ctx, r);
+                if (rv != APR_SUCCESS) {
+                    return rv;
+                }
+                APR_BUCKET_REMOVE(e);
+                APR_BRIGADE_INSERT_TAIL(ctx->proc_bb, e);
+                ctx->done = 1;
+                apr_pool_cleanup_run(r->pool, ctx, cleanup_inflate_ctx);
+                break;
+            }
+            if (APR_BUCKET_IS_METADATA(e)) {
+                APR_BUCKET_REMOVE(e);
+                APR_BRIGADE_INSERT_TAIL(ctx->proc_bb, e);
+                continue;
+            }
 
+            rv = apr_bucket_read(e, &data, &len, APR_BLOCK_READ);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            if (len) {
+                rv = inflate_data(ctx, data, len, r);
+                if (rv != APR_SUCCESS) {
+                    return rv;
+                }
+            }
             apr_bucket_delete(e);
         }
+        apr_brigade_cleanup(ctx->bb);
+    }
+
+    if (!APR_BRIGADE_EMPTY(ctx->proc_bb)) {
+        if (apr_brigade_partition(ctx->proc_bb, readbytes, &e)
+                == APR_INCOMPLETE) {
+            APR_BRIGADE_CONCAT(bb, ctx->proc_bb);
+        } else {
+            APR_BRIGADE_CONCAT(bb, ctx->proc_bb);
+            apr_brigade_split_ex(bb, e, ctx->proc_bb);
+        }
+        if (APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(bb))) {
+            ap_remove_input_filter(f);
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Output filter decompressing "Content-Encoding: zstd" responses, from a
+ * backend typically, for clients that do not accept zstd.
+ */
+static apr_status_t inflate_out_filter(ap_filter_t *f,
+                                       apr_bucket_brigade *bb) {
+
+    request_rec *r = f->r;
+    zstd_inflate_ctx_t *ctx = f->ctx;
+    apr_status_t rv;
+    apr_bucket *e;
+
+    if (APR_BRIGADE_EMPTY(bb)) {
+        return APR_SUCCESS;
+    }
+
+    if (!ctx) {
+        const zstd_dir_config_t *dconf;
+        const char *encoding;
+
+        /* only work on main request/no subrequests, with zstd content */
+        encoding = get_content_encoding(r);
+        if (!ap_is_initial_req(r) || r->status == HTTP_NO_CONTENT
+            || !encoding || ap_cstr_casecmp(encoding, "zstd") != 0) {
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+
+        /* Clients accepting zstd get it as is */
+        apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+        if (accept_q(get_accept(r), ZSTD_CODING_ZSTD)) {
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+
+        apr_table_unset(r->headers_out, "Content-Encoding");
+        apr_table_unset(r->err_headers_out, "Content-Encoding");
+        r->content_encoding = NULL;
+        apr_table_unset(r->headers_out, "Content-Length");
+        apr_table_unset(r->headers_out, "Content-MD5");
+
+        /* For 304 or HEAD responses, we only need to send out the headers */
+        if (r->status == HTTP_NOT_MODIFIED || r->header_only) {
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+
+        dconf = get_dir_config(r);
+        ctx = create_inflate_ctx(f, dconf, dconf->inflate_limit);
+        if (!ctx) {
+            return APR_ENOMEM;
+        }
+        f->ctx = ctx;
+    }
+
+    while ((e = APR_BRIGADE_FIRST(bb)) != APR_BRIGADE_SENTINEL(bb)) {
+        const char *data;
+        apr_size_t len;
+
+        if (APR_BUCKET_IS_EOS(e)) {
+            rv = inflate_finish(ctx, r);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(ctx->proc_bb, e);
+            rv = ap_pass_brigade(f->next, ctx->proc_bb);
+            apr_brigade_cleanup(ctx->proc_bb);
+            apr_pool_cleanup_run(r->pool, ctx, cleanup_inflate_ctx);
+            ap_remove_output_filter(f);
+            return rv;
+        }
+        if (APR_BUCKET_IS_METADATA(e)) {
+            int flush = APR_BUCKET_IS_FLUSH(e);
+
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(ctx->proc_bb, e);
+            if (flush) {
+                rv = ap_pass_brigade(f->next, ctx->proc_bb);
+                apr_brigade_cleanup(ctx->proc_bb);
+                if (rv != APR_SUCCESS) {
+                    return rv;
+                }
+            }
+            continue;
+        }
+
+        rv = apr_bucket_read(e, &data, &len, APR_BLOCK_READ);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        if (len) {
+            rv = inflate_data(ctx, data, len, r);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+        }
+        apr_bucket_delete(e);
+
+        /* What a bucket decompressed to goes right away, not to pile up */
+        if (!APR_BRIGADE_EMPTY(ctx->proc_bb)) {
+            rv = ap_pass_brigade(f->next, ctx->proc_bb);
+            apr_brigade_cleanup(ctx->proc_bb);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+        }
     }
+
     return APR_SUCCESS;
 }
 
@@ -484,46 +4574,355 @@ static apr_status_t zstd_post_config(
     ) {
 
     zstd_server_config_t *conf;
+    zstd_dir_config_t dconf;
+    ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_nbWorkers);
+    server_rec *sp;
+
     conf = ap_get_module_config(s->module_config, &zstd_module);
+
+    /* ZSTD_STATIC_LINKING_ONLY: the experimental API is only stable within
+     * a release. With a shared libzstd updated under the module, what
+     * depends on it is left out until the module is rebuilt.
+     */
+    experimental_api = (ZSTD_versionNumber() == ZSTD_VERSION_NUMBER);
+    if (!experimental_api) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(30353)
+                     "mod_zstd was built against zstd %s but zstd %s is "
+                     "loaded: ZstdOffloadThreads%s are ignored until it "
+                     "is rebuilt against the latter",
+                     ZSTD_VERSION_STRING, ZSTD_versionString(),
+                     ZSTD_HAS_STABLE_CBLOCK_SIZE
+                     ? "" : " and ZstdTargetCBlockSize");
+    }
+
+    /* libzstd built without multithreading support: no worker will ever
+     * be granted, whatever ZstdWorkers says.
+     */
+    if (ZSTD_isError(bounds.error) || bounds.upperBound == 0) {
+        conf->workers_limit = 0;
+    }
+
+    /* Dictionaries are digested at the level of their server */
+    for (sp = s; sp; sp = sp->next) {
+        zstd_server_config_t *sc;
+        int i;
+
+        sc = ap_get_module_config(sp->module_config, &zstd_module);
+        dconf = *(zstd_dir_config_t *)ap_get_module_config(sp->lookup_defaults,
+                                                           &zstd_module);
+        resolve_dir_config(&dconf);
+        for (i = 0; sc->dictionaries && i < sc->dictionaries->nelts; i++) {
+            zstd_dict_t *dict = &APR_ARRAY_IDX(sc->dictionaries, i,
+                                               zstd_dict_t);
+            /* inherited from the main server, already loaded */
+            if (dict->cdict) {
+                continue;
+            }
+            if (load_dictionary(dict, dconf.compression_level, p, sp)
+                    != APR_SUCCESS) {
+                return !OK;
+            }
+        }
+    }
+
+    dconf = *(zstd_dir_config_t *)ap_get_module_config(s->lookup_defaults,
+                                                       &zstd_module);
+    resolve_dir_config(&dconf);
+
+    /* Nothing to share before the configuration is final */
+    if (ap_state_query(AP_SQ_MAIN_STATE) != AP_SQ_MS_CREATE_PRE_CONFIG) {
+        stats_init(p, s);
+    }
+
     ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(30307)
-                 "mod_zstd cl:%d, wk:%d (v%s, zstd %s)",
-                 conf->compression_level,
-                 conf->workers,
+                 "mod_zstd cl:%d, wk:%d/%d (v%s, zstd %s)",
+                 dconf.compression_level,
+                 dconf.workers,
+                 conf->workers_limit,
                  MOD_ZSTD_VERSION,
                  ZSTD_versionString());
     ap_add_version_component(p, "mod_zstd/" MOD_ZSTD_VERSION);
     return OK;
 }
 
+static void zstd_child_init(apr_pool_t *p, server_rec *s) {
+
+    zstd_server_config_t *conf;
+    conf = ap_get_module_config(s->module_config, &zstd_module);
+
+    workers_limit = (apr_uint32_t)conf->workers_limit;
+    if (ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads_per_child) != APR_SUCCESS
+        || threads_per_child < 1) {
+        threads_per_child = 1;
+    }
+    apr_atomic_set32(&workers_busy, 0);
+    memory_limit = (apr_uint64_t)conf->max_memory;
+    apr_atomic_set64(&memory_used, 0);
+
+#if ZSTD_HAS_THREAD_POOL
+    /* Registered before the context pools, to be cleaned up after them */
+    if (conf->offload_threads > 0 && experimental_api
+        && ZSTD_cParam_getBounds(ZSTD_c_nbWorkers).upperBound > 0) {
+        offload_pool = ZSTD_createThreadPool(conf->offload_threads);
+        if (offload_pool) {
+            apr_pool_cleanup_register(p, offload_pool, cleanup_offload_pool,
+                                      apr_pool_cleanup_null);
+        } else {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(30343)
+                         "Failed to create %d offload threads, falling back "
+                         "to ZstdWorkersLimit", conf->offload_threads);
+        }
+    }
+#endif
+
+    cctx_pool = apr_pcalloc(p, sizeof(*cctx_pool));
+    cctx_pool->max_idle = conf->cctx_pool_size;
+    cctx_pool->idle = apr_pcalloc(p, sizeof(*cctx_pool->idle)
+                                     * (conf->cctx_pool_size + 1));
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&cctx_pool->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                p) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(30309)
+                     "Failed to create context pool mutex, pooling disabled");
+        cctx_pool->max_idle = 0;
+    }
+#endif
+    apr_pool_cleanup_register(p, cctx_pool, cleanup_cctx_pool,
+                              apr_pool_cleanup_null);
+    if (conf->cctx_prewarm > 0) {
+        cctx_pool_prewarm(s, conf->cctx_prewarm);
+    }
+
+    dctx_pool = apr_pcalloc(p, sizeof(*dctx_pool));
+    dctx_pool->max_idle = conf->cctx_pool_size;
+    dctx_pool->idle = apr_pcalloc(p, sizeof(*dctx_pool->idle)
+                                     * (conf->cctx_pool_size + 1));
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&dctx_pool->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                p) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(30329)
+                     "Failed to create decompression context pool mutex, "
+                     "pooling disabled");
+        dctx_pool->max_idle = 0;
+    }
+#endif
+    apr_pool_cleanup_register(p, dctx_pool, cleanup_dctx_pool,
+                              apr_pool_cleanup_null);
+
+#if APR_HAS_THREADS
+    for (; s; s = s->next) {
+        conf = ap_get_module_config(s->module_config, &zstd_module);
+        if (conf->cache_root) {
+            break;
+        }
+    }
+    /* A single thread, started on demand, which bounds the CPU taken by
+     * cache compression to one core per child. It runs at the priority of
+     * the child, as the other threads serving requests.
+     */
+    if (s && (apr_thread_mutex_create(&cache_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                      p) != APR_SUCCESS
+              || apr_thread_pool_create(&cache_threads, 0, 1, p)
+                     != APR_SUCCESS)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(30315)
+                     "Failed to create cache thread, ZstdCacheRoot will "
+                     "only serve existing entries");
+        cache_threads = NULL;
+    }
+    /* ZstdCacheDynamic needs it too, to wait for a response being cached */
+    if (s && cache_mutex
+        && apr_thread_cond_create(&cache_cond, p) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(30347)
+                     "Failed to create cache condition variable, "
+                     "ZstdCacheDynamic disabled");
+        cache_cond = NULL;
+    }
+#endif
+}
+
+/*
+ * Order the encoders before any of them runs, for ZstdPreference to hold
+ * whatever their order in the configuration.
+ */
+static void zstd_insert_filter(request_rec *r) {
+
+    const zstd_dir_config_t *dconf;
+
+    if (r->main || apr_table_get(r->subprocess_env, "no-zstd")) {
+        return;
+    }
+    dconf = get_dir_config(r);
+    if (dconf->enabled) {
+        order_encoders(r, dconf);
+    }
+}
+
 static void register_hooks(apr_pool_t *p) {
 
     ap_register_output_filter("ZSTD_COMPRESS", compress_filter, NULL,
                               AP_FTYPE_CONTENT_SET);
+    ap_register_input_filter("ZSTD_DECOMPRESS", decompress_in_filter, NULL,
+                             AP_FTYPE_CONTENT_SET);
+    ap_register_output_filter("ZSTD_INFLATE", inflate_out_filter, NULL,
+                              AP_FTYPE_RESOURCE - 1);
     ap_hook_post_config(zstd_post_config, NULL, NULL, APR_HOOK_LAST);
+    ap_hook_child_init(zstd_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_insert_filter(zstd_insert_filter, NULL, NULL, APR_HOOK_LAST);
+    ap_hook_handler(zstd_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, zstd_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
 }
 
 static const command_rec cmds[] = {
 
     AP_INIT_TAKE12("ZstdFilterNote", set_filter_note,
                    NULL, RSRC_CONF,
-                   "Set a note to report on compression ratio"),
+                   "Set a note to report on compression ratio, or on the "
+                   "given figure: Input, Output, Time, CPU, Calls, Flushes, "
+                   "Buffered, Pool, Level or Workers"),
+    AP_INIT_FLAG("ZstdCompression", set_compression,
+                 NULL, RSRC_CONF | ACCESS_CONF,
+                 "Whether responses are compressed (default On)"),
     AP_INIT_TAKE1("ZstdCompressionLevel", set_compression_level,
-                  NULL, RSRC_CONF,
+                  NULL, RSRC_CONF | ACCESS_CONF,
                   "Compression level between min and max (higher level means "
                   "better compression but slower)"),
-    AP_INIT_TAKE1("ZstdAlterETag", set_etag_mode,
+    AP_INIT_TAKE12("ZstdAdaptiveLevel", set_adaptive_level,
+                   NULL, RSRC_CONF | ACCESS_CONF,
+                   "Minimum and maximum compression level to pick from "
+                   "depending on load, or 'Off' (default)"),
+    AP_INIT_TAKE1("ZstdWorkers", set_workers,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Maximum number of zstd worker threads used by a response "
+                  "(0 for single-threaded compression)"),
+    AP_INIT_TAKE1("ZstdWorkersLimit", set_workers_limit,
                   NULL, RSRC_CONF,
+                  "Maximum number of zstd worker threads running at once in "
+                  "a child process, across all responses"),
+    AP_INIT_TAKE1("ZstdOffloadThreads", set_offload_threads,
+                  NULL, RSRC_CONF,
+                  "Number of threads per child process large responses are "
+                  "compressed by, shared by all of them (0 disables)"),
+    AP_INIT_TAKE1("ZstdWorkersMinSize", set_workers_min_size,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Minimum response size, in bytes, for compression to use "
+                  "worker threads"),
+    AP_INIT_TAKE1("ZstdMinLength", set_min_length,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Minimum response size, in bytes, worth compressing "
+                  "(default 256)"),
+    AP_INIT_TAKE1("ZstdMaxLength", set_max_length,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Maximum response size, in bytes, to compress "
+                  "(0 for no limit, default)"),
+    AP_INIT_FLAG("ZstdProbe", set_probe,
+                 NULL, RSRC_CONF | ACCESS_CONF,
+                 "Send as is responses whose first bytes look incompressible "
+                 "(default On)"),
+    AP_INIT_TAKE123("ZstdPreference", set_preference,
+                    NULL, RSRC_CONF | ACCESS_CONF,
+                    "Codings by rank among zstd, br and gzip, for when "
+                    "mod_brotli and mod_deflate are on the response too "
+                    "(default zstd br gzip)"),
+    AP_INIT_TAKE1("ZstdWindowLog", set_window_log,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Log2 of the compression window, at most 23 for browsers "
+                  "(0 for the level's, default)"),
+    AP_INIT_FLAG("ZstdLongDistanceMatching", set_ldm,
+                 NULL, RSRC_CONF | ACCESS_CONF,
+                 "Look for matches far back in the window (default Off)"),
+    AP_INIT_TAKE1("ZstdStrategy", set_strategy,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Match finder, from 'fast' to 'btultra2' ('default' for "
+                  "the level's)"),
+    AP_INIT_FLAG("ZstdChecksum", set_checksum,
+                 NULL, RSRC_CONF | ACCESS_CONF,
+                 "Append a checksum of the content to frames (default Off)"),
+    AP_INIT_TAKE1("ZstdTargetCBlockSize", set_target_cblock_size,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Size compressed blocks should fit in, so that they can "
+                  "be decoded as soon as received (0 for no target)"),
+    AP_INIT_TAKE1("ZstdMaxInflateLimit", set_inflate_limit,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Maximum size, in bytes, of decompressed bodies (0 for "
+                  "LimitRequestBody on requests and no limit on responses)"),
+    AP_INIT_TAKE1("ZstdMaxInflateRatio", set_inflate_ratio,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Maximum ratio of decompressed to compressed size "
+                  "(0 for no limit, default 200)"),
+    AP_INIT_TAKE1("ZstdMaxInflateWindowLog", set_inflate_window_log,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Log2 of the largest window decompression accepts "
+                  "(default 23)"),
+    AP_INIT_TAKE23("ZstdDictionary", set_dictionary,
+                   NULL, RSRC_CONF,
+                   "Dictionary file, its id and optionally the URL pattern "
+                   "clients should use it for"),
+    AP_INIT_TAKE1("ZstdAlterETag", set_etag_mode,
+                  NULL, RSRC_CONF | ACCESS_CONF,
                   "Set how mod_zstd should modify ETag response headers: "
                   "'AddSuffix' (default), 'NoChange', 'Remove'"),
+    AP_INIT_TAKE1("ZstdFlushPolicy", set_flush_policy,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "When compressed output is flushed to the client: 'auto' "
+                  "(default), 'bucket', 'eos', 'bytes=N' or 'ms=N'"),
+    AP_INIT_ITERATE("ZstdStreamTypes", set_stream_types,
+                    NULL, RSRC_CONF | ACCESS_CONF,
+                    "Content types compressed for latency, at ZstdStreamLevel "
+                    "and flushed as they come (default text/event-stream, "
+                    "'none' for none)"),
+    AP_INIT_TAKE1("ZstdStreamLevel", set_stream_level,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Compression level of ZstdStreamTypes responses "
+                  "(default 3)"),
+    AP_INIT_FLAG("ZstdPrecompressed", set_precompressed,
+                 NULL, RSRC_CONF | ACCESS_CONF,
+                 "Send the '.zst' sidecar of static files when there is one "
+                 "(default Off)"),
+    AP_INIT_TAKE1("ZstdCacheRoot", set_cache_root,
+                  NULL, RSRC_CONF,
+                  "Directory where compressed static files are cached"),
+    AP_INIT_TAKE1("ZstdCacheLevel", set_cache_level,
+                  NULL, RSRC_CONF,
+                  "Compression level of cached static files (default 19)"),
+    AP_INIT_TAKE1("ZstdCacheFrameSize", set_cache_frame_size,
+                  NULL, RSRC_CONF,
+                  "Cache static files as independent frames of this many "
+                  "bytes with a seek table (0 for one frame, the default)"),
+    AP_INIT_TAKE1("ZstdCacheMaxSize", set_cache_max_size,
+                  NULL, RSRC_CONF,
+                  "Bytes of ZstdCacheRoot beyond which the least recently "
+                  "used entries are removed (0 for no limit, the default)"),
+    AP_INIT_FLAG("ZstdCacheDynamic", set_cache_dynamic,
+                 NULL, RSRC_CONF | ACCESS_CONF,
+                 "Cache compressed dynamic responses with a strong ETag "
+                 "in ZstdCacheRoot (default Off)"),
+    AP_INIT_TAKE1("ZstdOutputBufferSize", set_output_buffer_size,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "Size of the buffers compressed output is staged in "
+                  "(0 for zstd's recommended ZSTD_CStreamOutSize())"),
+    AP_INIT_TAKE1("ZstdContextPoolSize", set_cctx_pool_size,
+                  NULL, RSRC_CONF,
+                  "Maximum number of idle compression contexts kept per "
+                  "child process for reuse (0 disables pooling)"),
+    AP_INIT_TAKE1("ZstdContextPrewarm", set_cctx_prewarm,
+                  NULL, RSRC_CONF,
+                  "Number of compression contexts each child process "
+                  "creates at startup, up to ZstdContextPoolSize (default 0)"),
+    AP_INIT_TAKE1("ZstdMaxMemory", set_max_memory,
+                  NULL, RSRC_CONF,
+                  "Bytes of compression contexts per child process, beyond "
+                  "which responses are compressed with less or not at all "
+                  "(0 for no limit, the default)"),
     {NULL}
 };
 
 AP_DECLARE_MODULE(zstd) = {
     STANDARD20_MODULE_STUFF,
-    NULL,                      /* create per-directory config structure */
-    NULL,                      /* merge per-directory config structures */
+    create_dir_config,         /* create per-directory config structure */
+    merge_dir_config,          /* merge per-directory config structures */
     create_server_config,      /* create per-server config structure */
-    NULL,                      /* merge per-server config structures */
+    merge_server_config,       /* merge per-server config structures */
     cmds,                      /* command apr_table_t */
     register_hooks             /* register hooks */
 };
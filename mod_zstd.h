@@ -16,25 +16,375 @@
 
 #define MOD_ZSTD_VERSION "1.0.3"
 
+/* ZSTD_createThreadPool() and ZSTD_CCtx_refThreadPool(), for ZstdOffload */
+#if ZSTD_VERSION_NUMBER >= 10500
+#define ZSTD_HAS_THREAD_POOL 1
+#else
+#define ZSTD_HAS_THREAD_POOL 0
+#endif
+
+/* ZSTD_c_targetCBlockSize in the stable API, for ZstdTargetCBlockSize */
+#if ZSTD_VERSION_NUMBER >= 10506
+#define ZSTD_HAS_STABLE_CBLOCK_SIZE 1
+#else
+#define ZSTD_HAS_STABLE_CBLOCK_SIZE 0
+#endif
+
+/* apr_atomic_*64(), for the statistics and ZstdMaxMemory */
+#if !APR_VERSION_AT_LEAST(1, 7, 0)
+#error "mod_zstd requires APR 1.7 or later"
+#endif
+
+/* apr_bucket_file_set_buf_size(), APR-util 1.6 */
+#if APR_MAJOR_VERSION > 1
+#define ZSTD_HAS_FILE_BUF_SIZE 1
+#elif APU_VERSION_AT_LEAST(1, 6, 0)
+#define ZSTD_HAS_FILE_BUF_SIZE 1
+#else
+#define ZSTD_HAS_FILE_BUF_SIZE 0
+#endif
+
+/* USDT probes of provider mod_zstd, for perf and bpftrace, when built with
+ * MOD_ZSTD_USDT (and <sys/sdt.h> of systemtap); compiled out otherwise.
+ */
+#ifdef MOD_ZSTD_USDT
+#define ZSTD_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(mod_zstd, name, a1, a2, a3)
+#define ZSTD_PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(mod_zstd, name, a1, a2, a3, a4)
+#else
+#define ZSTD_PROBE3(name, a1, a2, a3) \
+    ((void)(a1), (void)(a2), (void)(a3))
+#define ZSTD_PROBE4(name, a1, a2, a3, a4) \
+    ((void)(a1), (void)(a2), (void)(a3), (void)(a4))
+#endif
+
+/* Per-directory settings not configured */
+#define ZSTD_UNSET -1
+
 #define ZSTD_DEFAULT_COMPRESSION_LEVEL 15
+#define ZSTD_DEFAULT_CCTX_POOL_SIZE 8
+/* ZstdMaxMemory: level responses fall back to when the budget is short */
+#define ZSTD_DEGRADED_LEVEL 1
+/* Responses smaller than this are compressed single-threaded */
+#define ZSTD_DEFAULT_WORKERS_MIN_SIZE (1024 * 1024)
+/* ZstdAdaptiveLevel: how often the scoreboard is sampled */
+#define ZSTD_ADAPTIVE_SAMPLE_USEC 1000000
+/* ZstdAdaptiveLevel: responses this large count double in the load */
+#define ZSTD_ADAPTIVE_LARGE_SIZE (1024 * 1024)
+/* Level static files are compressed at for ZstdCacheRoot */
+#define ZSTD_DEFAULT_CACHE_LEVEL 19
+/* Static files compressed for the cache at once, per child process */
+#define ZSTD_CACHE_INFLIGHT_MAX 16
+/* ZstdCacheDynamic: how long a request waits for another caching the same */
+#define ZSTD_CACHE_WAIT_MSEC 1000
+/* ZstdCacheMaxSize: a child sweeps the cache each time it wrote this share
+ * of the limit, down to the limit less that share */
+#define ZSTD_CACHE_SWEEP_SHARE 16
+/* ZstdCacheMaxSize: how often the time of an entry in use is refreshed */
+#define ZSTD_CACHE_TOUCH_SEC 3600
+/* ZstdCacheFrameSize bounds, frames of the seekable format are at most 1GB */
+#define ZSTD_MIN_CACHE_FRAME_SIZE (64 * 1024)
+#define ZSTD_MAX_CACHE_FRAME_SIZE (1024 * 1024 * 1024)
+/* Seek table of the seekable format (zstd contrib/seekable_format) */
+#define ZSTD_SEEKABLE_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define ZSTD_SEEKABLE_FOOTER_SIZE 9
+/* Smallest ZstdOutputBufferSize accepted */
+#define ZSTD_MIN_OUTPUT_BUFFER_SIZE 4096
+/* ZstdFlushPolicy auto: flush a brigade arriving after this idle gap */
+#define ZSTD_DEFAULT_FLUSH_IDLE_MS 100
+/* ZstdStreamTypes: level, and compressed block size so that the client
+ * can decode a large event before all of it is compressed
+ */
+#define ZSTD_DEFAULT_STREAM_LEVEL 3
+#define ZSTD_DEFAULT_STREAM_TYPE "text/event-stream"
+#define ZSTD_STREAM_TARGET_CBLOCK_SIZE 4096
+/* Largest window browsers decode for Content-Encoding: zstd (RFC 9659) */
+#define ZSTD_BROWSER_WINDOWLOG_MAX 23
+/* Smaller bodies are sent as is, the frame overhead would outweigh gains */
+#define ZSTD_DEFAULT_MIN_LENGTH 256
+/* ZstdProbe: bytes sampled, and least of them worth a verdict */
+#define ZSTD_PROBE_SIZE 4096
+#define ZSTD_PROBE_MIN_SIZE 512
+/* ZstdProbe: entropy (bits per byte) above which data is incompressible */
+#define ZSTD_PROBE_MAX_ENTROPY 7.5
+
+/* ZstdMaxInflateRatio: only checked once this much was decompressed */
+#define ZSTD_INFLATE_RATIO_MIN_SIZE (1024 * 1024)
+#define ZSTD_DEFAULT_INFLATE_RATIO 200
+
+/* Compression Dictionary Transport (RFC 9842) "dcz" stream header */
+#define ZSTD_DCZ_MAGIC "\x5e\x2a\x4d\x18\x20\x00\x00\x00"
+#define ZSTD_DCZ_MAGIC_LEN 8
+#define ZSTD_SHA256_LEN 32
 
 typedef enum {
+    ETAG_MODE_UNSET = ZSTD_UNSET,
     ETAG_MODE_ADDSUFFIX = 0,
     ETAG_MODE_NOCHANGE = 1,
     ETAG_MODE_REMOVE = 2
 } etag_mode_e;
+
+typedef enum {
+    FLUSH_POLICY_UNSET = ZSTD_UNSET,
+    FLUSH_POLICY_AUTO = 0,
+    FLUSH_POLICY_BUCKET = 1,
+    FLUSH_POLICY_EOS = 2,
+    FLUSH_POLICY_BYTES = 3,
+    FLUSH_POLICY_MS = 4
+} flush_policy_e;
 	
+/* Content types statistics are kept for, see stats_type_names */
+typedef enum {
+    ZSTD_TYPE_HTML = 0,
+    ZSTD_TYPE_CSS,
+    ZSTD_TYPE_JAVASCRIPT,
+    ZSTD_TYPE_JSON,
+    ZSTD_TYPE_XML,
+    ZSTD_TYPE_SVG,
+    ZSTD_TYPE_TEXT,
+    ZSTD_TYPE_OTHER,
+    ZSTD_TYPE_MAX
+} zstd_type_e;
+
+/* Why a response was not compressed, see stats_skip_names */
+typedef enum {
+    ZSTD_SKIP_INELIGIBLE = 0,
+    ZSTD_SKIP_ENCODED,
+    ZSTD_SKIP_NOT_ACCEPTED,
+    ZSTD_SKIP_NOT_MODIFIED,
+    ZSTD_SKIP_TOO_SMALL,
+    ZSTD_SKIP_TOO_LARGE,
+    ZSTD_SKIP_INCOMPRESSIBLE,
+    ZSTD_SKIP_PREFERENCE,
+    ZSTD_SKIP_RANGE,
+    ZSTD_SKIP_MEMORY,
+    ZSTD_SKIP_ERROR,
+    ZSTD_SKIP_MAX
+} zstd_skip_e;
+
+/* ZstdFilterNote types, see filter_note_names */
+typedef enum {
+    FILTER_NOTE_RATIO = 0,
+    FILTER_NOTE_INPUT,
+    FILTER_NOTE_OUTPUT,
+    FILTER_NOTE_TIME,
+    FILTER_NOTE_CPU,
+    FILTER_NOTE_CALLS,
+    FILTER_NOTE_FLUSHES,
+    FILTER_NOTE_BUFFERED,
+    FILTER_NOTE_POOL,
+    FILTER_NOTE_LEVEL,
+    FILTER_NOTE_WORKERS,
+    FILTER_NOTE_MAX
+} filter_note_e;
+
+/* Content codings negotiated with Accept-Encoding, see coding_names */
+typedef enum {
+    ZSTD_CODING_ZSTD = 0,
+    ZSTD_CODING_DCZ,
+    ZSTD_CODING_BR,
+    ZSTD_CODING_GZIP,
+    ZSTD_CODING_MAX
+} zstd_coding_e;
+
+/* Request note naming the coding ZstdPreference ranked first */
+#define ZSTD_NOTE_CODING "zstd-coding"
+
+/*
+ * Accept-Encoding of a request, parsed once: q-values in thousandths,
+ * ZSTD_UNSET for codings not listed.
+ */
+typedef struct zstd_accept_t {
+    int q[ZSTD_CODING_MAX];
+    int q_any;                  /* "*" */
+} zstd_accept_t;
+
+/* Upper bounds (ms) of the compression time histogram, last is +Inf */
+#define ZSTD_STATS_TIME_BOUNDS { 1, 4, 16, 64, 256, 1024 }
+#define ZSTD_STATS_TIME_BUCKETS 7
+
+/* Counters of a (server, content type), in shared memory */
+typedef struct zstd_stats_t {
+    apr_uint64_t compressed;
+    apr_uint64_t precompressed;
+    apr_uint64_t skipped[ZSTD_SKIP_MAX];
+    apr_uint64_t bytes_in;
+    apr_uint64_t bytes_out;
+    apr_uint64_t compress_usec;
+    apr_uint64_t cpu_usec;
+    apr_uint64_t pool_hits;
+    apr_uint64_t pool_misses;
+    apr_uint64_t time_hist[ZSTD_STATS_TIME_BUCKETS];
+} zstd_stats_t;
+
+typedef struct zstd_dict_t {
+    const char *path;
+    const char *id;
+    const char *match;
+    const char *hash;   /* ":base64(sha-256):", as in Available-Dictionary */
+    unsigned char sha256[ZSTD_SHA256_LEN];
+    ZSTD_CDict *cdict;
+} zstd_dict_t;
+
 typedef struct zstd_server_config_t {
-    int compression_level, workers;
-    etag_mode_e etag_mode;
-    const char *note_ratio_name;
-    const char *note_input_name;
-    const char *note_output_name;
+    int workers_limit;
+    int offload_threads;
+    int cctx_pool_size;
+    int cctx_prewarm;
+    apr_off_t max_memory;
+    const char *cache_root;
+    int cache_level;
+    apr_off_t cache_frame_size;
+    apr_off_t cache_max_size;
+    /* ZstdFilterNote: request note names, NULL when not left */
+    const char *note_names[FILTER_NOTE_MAX];
+    apr_array_header_t *dictionaries;
+    int stats_index;
 } zstd_server_config_t;
 
+/*
+ * Per-directory settings, ZSTD_UNSET until configured. They are resolved
+ * (defaults filled in) once per request, see get_dir_config().
+ */
+typedef struct zstd_dir_config_t {
+    int enabled;
+    int compression_level;
+    int adaptive_min, adaptive_max;
+    int workers;
+    apr_off_t workers_min_size;
+    flush_policy_e flush_policy;
+    apr_off_t flush_threshold;
+    etag_mode_e etag_mode;
+    int precompressed;
+    int out_buffer_size;
+    apr_off_t min_length;
+    apr_off_t max_length;
+    int probe;
+    int window_log;
+    int ldm;
+    int strategy;
+    int checksum;
+    int target_cblock_size;
+    apr_off_t inflate_limit;
+    int inflate_ratio;
+    int inflate_window_log;
+    int cache_dynamic;
+    /* ZstdStreamTypes, compressed for latency at stream_level */
+    apr_array_header_t *stream_types;
+    int stream_level;
+    /* ZstdPreference: codings by rank, up to a ZSTD_UNSET */
+    int preference[ZSTD_CODING_MAX];
+} zstd_dir_config_t;
+
+/* Parameters a ZSTD_CCtx is configured with; contexts are pooled by this. */
+typedef struct zstd_cparams_t {
+    int compression_level;
+    int workers;
+    int window_log;
+    int ldm;
+    int strategy;
+    int checksum;
+    int target_cblock_size;
+    const ZSTD_CDict *cdict;
+} zstd_cparams_t;
+
+typedef struct zstd_pooled_cctx_t {
+    ZSTD_CCtx *cctx;
+    zstd_cparams_t params;
+    apr_size_t reserved;        /* of ZstdMaxMemory */
+} zstd_pooled_cctx_t;
+
+typedef struct zstd_cctx_pool_t {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    zstd_pooled_cctx_t *idle;
+    int nidle, max_idle;
+} zstd_cctx_pool_t;
+
+typedef struct zstd_dctx_pool_t {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    ZSTD_DCtx **idle;
+    int nidle, max_idle;
+} zstd_dctx_pool_t;
+
+/* Background compression of a static file into the cache */
+typedef struct zstd_cache_job_t {
+    apr_pool_t *pool;
+    server_rec *s;
+    const char *source;
+    const char *target;
+    apr_uint64_t key;
+    apr_off_t size;
+    int level;
+    apr_off_t frame_size;       /* 0 for a single frame */
+} zstd_cache_job_t;
+
+/* ZstdCacheMaxSize: removal of the least recently used entries */
+typedef struct zstd_cache_sweep_t {
+    apr_pool_t *pool;
+    server_rec *s;
+    const char *root;
+    apr_off_t max_size;
+} zstd_cache_sweep_t;
+
+typedef struct zstd_cache_entry_t {
+    const char *path;
+    apr_off_t size;
+    apr_time_t mtime;
+} zstd_cache_entry_t;
+
+/*
+ * Until bb is created, the filter has not decided whether to compress yet
+ * and holds the beginning of the body (see ZstdMinLength).
+ */
 typedef struct zstd_ctx_t {
+    const zstd_dir_config_t *dconf;
     ZSTD_CCtx *cctx;
+    zstd_cparams_t params;
+    const zstd_dict_t *dict;
+    const char *coding;
+    apr_bucket_brigade *held;
     apr_bucket_brigade *bb;
+    ZSTD_outBuffer out;
+    apr_size_t out_size;
     apr_off_t total_in;
     apr_off_t total_out;
+    apr_off_t unflushed_in;
+    apr_size_t pending_out;
+    apr_time_t last_seen;
+    apr_time_t last_flush;
+    zstd_stats_t *stats;
+    int pool_hit;
+    apr_size_t reserved;        /* of ZstdMaxMemory, given to the pool */
+    int offloaded;
+    int streaming;              /* ZstdStreamTypes */
+    int cached;                 /* served from ZstdCacheDynamic, rest ignored */
+    apr_file_t *cache_file;     /* compressed output written aside to */
+    const char *cache_tmp;
+    const char *cache_path;
+    apr_uint64_t cache_key;
+    apr_int64_t compress_usec;
+    apr_int64_t cpu_usec;
+    apr_int64_t cpu_mark;       /* thread CPU time when sampling, or 0 */
+    int calls;                  /* of ZSTD_compressStream2() */
+    int flushes;
+    apr_size_t max_pending_out;
 } zstd_ctx_t;
+
+/* Decompression of a request (ZSTD_DECOMPRESS) or response (ZSTD_INFLATE) */
+typedef struct zstd_inflate_ctx_t {
+    const zstd_dir_config_t *dconf;
+    ZSTD_DCtx *dctx;
+    apr_bucket_brigade *bb;
+    apr_bucket_brigade *proc_bb;
+    apr_off_t limit;
+    apr_off_t total_in;
+    apr_off_t total_out;
+    size_t hint;        /* from ZSTD_decompressStream(), 0 at a frame end */
+    int done;
+} zstd_inflate_ctx_t;
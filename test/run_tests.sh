@@ -0,0 +1,352 @@
+#!/bin/sh
+#
+# Integration tests of mod_zstd: boots a throwaway httpd (-X) with the
+# module on 127.0.0.1 and checks its responses with curl and zstd.
+#
+#   test/run_tests.sh /path/to/mod_zstd.so
+#
+# Environment: APXS (apxs), HTTPD (from apxs), CURL (curl), ZSTD (zstd),
+# TEST_PORT (8529, and the next one). Exits 77 when something needed is
+# missing, for make check and ctest to report the tests as skipped.
+#
+# Written without an httpd at hand: it has not been run against one yet,
+# and its expectations may need adjusting the first time it is.
+#
+
+MODULE=$1
+APXS=${APXS:-apxs}
+CURL=${CURL:-curl}
+ZSTD=${ZSTD:-zstd}
+PORT=${TEST_PORT:-8529}
+CACHE_PORT=$((PORT + 1))
+
+skip() {
+    echo "SKIP: $*"
+    exit 77
+}
+
+[ -n "$MODULE" ] && [ -f "$MODULE" ] || skip "no module given, or not built"
+command -v "$APXS" >/dev/null 2>&1 || skip "$APXS not found"
+command -v "$CURL" >/dev/null 2>&1 || skip "$CURL not found"
+command -v "$ZSTD" >/dev/null 2>&1 || skip "$ZSTD not found"
+
+MODULE=$(cd "$(dirname "$MODULE")" && pwd)/$(basename "$MODULE")
+LIBEXECDIR=$("$APXS" -q LIBEXECDIR)
+if [ -z "$HTTPD" ]; then
+    HTTPD=$("$APXS" -q SBINDIR)/$("$APXS" -q progname)
+fi
+[ -x "$HTTPD" ] || skip "httpd not found ($HTTPD), set HTTPD"
+
+T=$(mktemp -d "${TMPDIR:-/tmp}/mod_zstd-test.XXXXXX") || exit 1
+PID=
+FAILED=0
+COUNT=0
+
+cleanup() {
+    if [ -n "$PID" ]; then
+        kill "$PID" 2>/dev/null
+        wait "$PID" 2>/dev/null
+    fi
+    if [ "$FAILED" -ne 0 ] && [ -f "$T/error.log" ]; then
+        echo "--- error.log"
+        cat "$T/error.log"
+    fi
+    rm -rf "$T"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Modules httpd was not built with are loaded from LIBEXECDIR, if there
+STATIC=$("$HTTPD" -l 2>/dev/null)
+load() {
+    case "$STATIC" in
+        *"mod_$1.c"*) return 0 ;;
+    esac
+    if [ -f "$LIBEXECDIR/mod_$1.so" ]; then
+        echo "LoadModule $1_module $LIBEXECDIR/mod_$1.so"
+        return 0
+    fi
+    return 1
+}
+has() {
+    case "$STATIC" in
+        *"mod_$1.c"*) return 0 ;;
+    esac
+    [ -f "$LIBEXECDIR/mod_$1.so" ]
+}
+
+MODULES=
+for mpm in prefork event worker; do
+    if has "mpm_$mpm"; then
+        MODULES="$MODULES
+$(load "mpm_$mpm")"
+        break
+    fi
+done
+has filter || skip "mod_filter not found"
+for m in unixd mime log_config filter; do
+    MODULES="$MODULES
+$(load $m)"
+done
+if has cgi; then
+    MODULES="$MODULES
+$(load cgi)"
+elif has cgid; then
+    MODULES="$MODULES
+$(load cgid)
+ScriptSock $T/cgid.sock"
+else
+    skip "neither mod_cgi nor mod_cgid"
+fi
+# ZstdPreference is checked against mod_deflate when there is one
+DEFLATE=
+if has deflate; then
+    DEFLATE="$(load deflate)
+<Location \"/pref/\">
+    SetOutputFilter ZSTD_COMPRESS;DEFLATE
+    ZstdPreference gzip zstd
+</Location>
+<Location \"/both/\">
+    SetOutputFilter DEFLATE;ZSTD_COMPRESS
+    ZstdMinLength 100000
+</Location>
+AddOutputFilterByType DEFLATE application/json"
+fi
+
+# Content
+mkdir -p "$T/htdocs/pre" "$T/htdocs/pref" "$T/htdocs/both" \
+    "$T/htdocs/cgi-bin" "$T/cache"
+seq 1 6000 | sed 's/$/: a line of compressible text for mod_zstd/' \
+    > "$T/htdocs/big.txt"
+echo "tiny" > "$T/htdocs/small.txt"
+seq 1 3000 | sed 's/$/: a line of precompressed text/' \
+    > "$T/htdocs/pre/pre.txt"
+"$ZSTD" -q -19 "$T/htdocs/pre/pre.txt" -o "$T/htdocs/pre/pre.txt.zst"
+"$ZSTD" -q "$T/htdocs/big.txt" -o "$T/big.txt.zst"
+cp "$T/htdocs/big.txt" "$T/htdocs/bytype.html"
+cp "$T/htdocs/big.txt" "$T/htdocs/pref/big.txt"
+cp "$T/htdocs/big.txt" "$T/htdocs/both/big.txt"
+head -n 2000 "$T/htdocs/big.txt" > "$T/htdocs/both/mid.txt"
+cp "$T/htdocs/big.txt" "$T/htdocs/data.json"
+
+cat > "$T/htdocs/cgi-bin/stream.cgi" <<'EOF'
+#!/bin/sh
+printf 'Content-Type: text/event-stream\r\n\r\n'
+printf 'data: first\n\n'
+sleep 3
+printf 'data: second\n\n'
+EOF
+cat > "$T/htdocs/cgi-bin/dynamic.cgi" <<EOF
+#!/bin/sh
+printf 'Content-Type: text/plain\r\n\r\n'
+cat "$T/htdocs/big.txt"
+EOF
+cat > "$T/htdocs/cgi-bin/echo.cgi" <<'EOF'
+#!/bin/sh
+printf 'Content-Type: application/octet-stream\r\n\r\n'
+cat
+EOF
+chmod 755 "$T/htdocs/cgi-bin/"*.cgi
+
+# When root, the child runs as User: everything must be reachable by it
+if [ "$(id -u)" = 0 ]; then
+    chmod -R a+rX "$T"
+    chmod 1777 "$T/cache"
+fi
+
+cat > "$T/httpd.conf" <<EOF
+ServerRoot "$T"
+ServerName 127.0.0.1
+Listen 127.0.0.1:$PORT
+Listen 127.0.0.1:$CACHE_PORT
+PidFile "$T/httpd.pid"
+ErrorLog "$T/error.log"
+LogLevel warn zstd:debug
+$MODULES
+$DEFLATE
+LoadModule zstd_module "$MODULE"
+
+TypesConfig /dev/null
+AddType text/plain .txt
+AddType text/html .html
+AddType application/json .json
+DocumentRoot "$T/htdocs"
+<Directory "$T/htdocs/cgi-bin">
+    Options +ExecCGI
+    SetHandler cgi-script
+</Directory>
+
+ZstdCompressionLevel 3
+<LocationMatch "^/(big|small)\.txt$|^/pre/|^/cgi-bin/(stream|dynamic)">
+    SetOutputFilter ZSTD_COMPRESS
+</LocationMatch>
+<Location "/pre/">
+    ZstdPrecompressed On
+</Location>
+<Location "/cgi-bin/echo.cgi">
+    SetInputFilter ZSTD_DECOMPRESS
+</Location>
+AddOutputFilterByType ZSTD_COMPRESS text/html
+
+<VirtualHost 127.0.0.1:$CACHE_PORT>
+    DocumentRoot "$T/htdocs"
+    ZstdCacheRoot "$T/cache"
+    ZstdCacheLevel 9
+</VirtualHost>
+EOF
+
+"$HTTPD" -d "$T" -f "$T/httpd.conf" -X &
+PID=$!
+i=0
+until "$CURL" -s -o /dev/null "http://127.0.0.1:$PORT/small.txt"; do
+    i=$((i + 1))
+    if [ $i -ge 50 ] || ! kill -0 "$PID" 2>/dev/null; then
+        FAILED=1
+        echo "httpd did not start"
+        exit 1
+    fi
+    sleep 0.1
+done
+
+# fetch URL [curl options]: response into $T/body, headers into $T/headers
+fetch() {
+    url=$1
+    shift
+    rm -f "$T/body" "$T/headers"
+    "$CURL" -s -o "$T/body" -D "$T/headers" "$@" "http://127.0.0.1:$url"
+}
+status() {
+    sed -n '1s/^[^ ]* \([0-9]*\).*/\1/p' "$T/headers"
+}
+header() {
+    grep -i "^$1:" "$T/headers" | tail -n 1 | cut -d: -f2- \
+        | tr -d '\r' | sed 's/^ *//'
+}
+body_is() {
+    cmp -s "$T/body" "$1"
+}
+unzstd_is() {
+    "$ZSTD" -q -d -c "$T/body" 2>/dev/null | cmp -s - "$1"
+}
+check() {
+    desc=$1
+    shift
+    COUNT=$((COUNT + 1))
+    if "$@"; then
+        echo "ok $COUNT - $desc"
+    else
+        echo "not ok $COUNT - $desc"
+        FAILED=$((FAILED + 1))
+    fi
+}
+eq() {
+    [ "$1" = "$2" ] || { echo "# expected '$2', got '$1'"; return 1; }
+}
+
+BIG=$T/htdocs/big.txt
+ZSTD_AE="Accept-Encoding: gzip, zstd"
+
+# Negotiation
+fetch $PORT/big.txt
+check "identity without Accept-Encoding" eq "$(header Content-Encoding)" ""
+check "identity body" body_is "$BIG"
+IDENTITY_ETAG=$(header ETag)
+LAST_MODIFIED=$(header Last-Modified)
+
+fetch $PORT/big.txt -H "$ZSTD_AE"
+check "zstd when accepted" eq "$(header Content-Encoding)" zstd
+check "Vary: Accept-Encoding" eq "$(header Vary | grep -ci accept-encoding)" 1
+check "zstd round trip" unzstd_is "$BIG"
+check "ETag suffixed" eq "$(header ETag)" "${IDENTITY_ETAG%\"}-zstd\""
+
+fetch $PORT/big.txt -H "Accept-Encoding: zstd;q=0, gzip"
+check "not when refused with q=0" eq "$(header Content-Encoding)" ""
+
+fetch $PORT/small.txt -H "$ZSTD_AE"
+check "not below ZstdMinLength" eq "$(header Content-Encoding)" ""
+
+fetch $PORT/bytype.html -H "$ZSTD_AE"
+check "AddOutputFilterByType" eq "$(header Content-Encoding)" zstd
+check "AddOutputFilterByType round trip" unzstd_is "$BIG"
+
+if [ -n "$DEFLATE" ]; then
+    fetch $PORT/pref/big.txt -H "$ZSTD_AE"
+    check "ZstdPreference picks gzip" eq "$(header Content-Encoding)" gzip
+    check "ZstdPreference gzip round trip" \
+        sh -c "gzip -d -c '$T/body' 2>/dev/null | cmp -s - '$BIG'"
+    fetch $PORT/pref/big.txt -H "Accept-Encoding: zstd"
+    check "ZstdPreference falls back to zstd" \
+        eq "$(header Content-Encoding)" zstd
+    fetch $PORT/both/big.txt -H "$ZSTD_AE"
+    check "ZstdPreference whatever the filter order" \
+        eq "$(header Content-Encoding)" zstd
+    fetch $PORT/both/mid.txt -H "$ZSTD_AE"
+    check "gzip when zstd declines" eq "$(header Content-Encoding)" gzip
+    fetch $PORT/data.json -H "Accept-Encoding: zstd, gzip"
+    check "gzip by type when zstd is for other types" \
+        eq "$(header Content-Encoding)" gzip
+    check "gzip by type round trip" \
+        sh -c "gzip -d -c '$T/body' 2>/dev/null | cmp -s - '$BIG'"
+fi
+
+# 304 and HEAD have the headers of the response they stand for
+fetch $PORT/big.txt -H "$ZSTD_AE" -H "If-Modified-Since: $LAST_MODIFIED"
+check "304" eq "$(status)" 304
+check "304 ETag suffixed" eq "$(header ETag)" "${IDENTITY_ETAG%\"}-zstd\""
+check "304 without body" test ! -s "$T/body"
+
+fetch $PORT/big.txt -H "$ZSTD_AE" -I
+check "HEAD" eq "$(status)" 200
+check "HEAD Content-Encoding" eq "$(header Content-Encoding)" zstd
+
+# Ranges are of the identity response unless it is precompressed
+fetch $PORT/big.txt -H "$ZSTD_AE" -H "Range: bytes=0-99"
+head -c 100 "$BIG" > "$T/range"
+check "Range 206" eq "$(status)" 206
+check "Range of identity" eq "$(header Content-Encoding)" ""
+check "Range body" body_is "$T/range"
+
+PRE=$T/htdocs/pre/pre.txt.zst
+fetch $PORT/pre/pre.txt -H "$ZSTD_AE"
+check "precompressed sidecar" body_is "$PRE"
+check "precompressed Content-Length" eq "$(header Content-Length)" \
+    "$(wc -c < "$PRE" | tr -d ' ')"
+
+fetch $PORT/pre/pre.txt -H "$ZSTD_AE" -H "Range: bytes=0-9"
+head -c 10 "$PRE" > "$T/range"
+check "Range of precompressed" eq "$(header Content-Encoding)" zstd
+check "Range of precompressed body" body_is "$T/range"
+
+# Dynamic content, request bodies
+fetch $PORT/cgi-bin/dynamic.cgi -H "$ZSTD_AE"
+check "dynamic zstd" eq "$(header Content-Encoding)" zstd
+check "dynamic round trip" unzstd_is "$BIG"
+
+fetch $PORT/cgi-bin/echo.cgi -H "Content-Encoding: zstd" \
+    --data-binary "@$T/big.txt.zst"
+check "ZSTD_DECOMPRESS" body_is "$BIG"
+
+# A stream gets each event as it comes, before the next one
+fetch $PORT/cgi-bin/stream.cgi -H "$ZSTD_AE" --max-time 2
+check "stream zstd" eq "$(header Content-Encoding)" zstd
+check "stream flushed" eq \
+    "$("$ZSTD" -q -d -c "$T/body" 2>/dev/null | grep -c '^data:')" 1
+fetch $PORT/cgi-bin/stream.cgi -H "$ZSTD_AE"
+check "stream complete" eq \
+    "$("$ZSTD" -q -d -c "$T/body" 2>/dev/null | grep -c '^data:')" 2
+
+# ZstdCacheRoot: compressed in the background, then sent with a length
+fetch $CACHE_PORT/big.txt -H "$ZSTD_AE"
+check "cache miss compressed on the fly" unzstd_is "$BIG"
+i=0
+while [ $i -lt 50 ]; do
+    fetch $CACHE_PORT/big.txt -H "$ZSTD_AE"
+    [ -n "$(header Content-Length)" ] && break
+    i=$((i + 1))
+    sleep 0.1
+done
+check "cache hit with Content-Length" test -n "$(header Content-Length)"
+check "cache hit round trip" unzstd_is "$BIG"
+
+echo "1..$COUNT"
+[ "$FAILED" -eq 0 ]